@@ -5,32 +5,199 @@
 //                  the command-line.
 //
 // -------------------------------------------------------------------------
-#define _GNU_SOURCE //cause stdio.h to include vasprintf
+#define _GNU_SOURCE //cause string.h to include memmem
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "util/dbg.h"
 #include "util/csv.h"
+#include "util/mmfile.h"
+#include "util/scan.h"
+#include "util/outbuf.h"
+#include "util/bufpool.h"
+#include "util/spill.h"
+#include "util/hist.h"
+#include "util/recidx.h"
+#include "util/pipeline.h"
+#include "util/uring.h"
 #define NUL_REPLACEMENT_CHARACTER 63   // This is a '?'
-
-#define Sasprintf(write_to, ...) {           \
-    char *tmp_string_to_extend = (write_to); \
-    asprintf(&(write_to), __VA_ARGS__);      \
-    free(tmp_string_to_extend);              \
-}
+#define BUFFER_SIZE (4 << 20)          // Default read size for unmapped input
+#define RECORD_BUFFER_SIZE (64 << 20)  // Default memory for a record read in pieces
+#define CSV_BATCH_ROWS 4096             // Records counted per batch in CSV mode
+#define CSV_FULL_STEP (1 << 20)        // Bytes parsed at a time by --csv-full with -m
+#define INDEX_STEP (1 << 16)           // Records between --write-index checkpoints
+#define CSV_RESOLVE_LIMIT (64 << 20)   // Most bytes counted to find a --byte-range bound
+#define FILE_SPILL_AFTER (4 << 20)     // Output of a FILE kept in memory until its turn
+#define PIPELINE_MIN_BLOCK (64 << 10)  // Smallest --buffer-size worth a reading thread
+
+// Exit statuses with --count or -m (errors still exit with -1):
+#define EXIT_NO_MISMATCH 0             // Every record matched
+#define EXIT_MISMATCH 1                // Some records did not
+#define EXIT_MAX_ERRORS 2              // A file was stopped after -m mismatches
 
 static const char *program_name = "ncount";
-static unsigned int fieldcount = 0;
+static uint64_t fieldcount = 0;
 static char *fieldcount_arg = 0;
 static char *delim_arg = "\t";
 static char *delim = "\t";
 static char delim_csv = CSV_COMMA;
 static char *quote_arg = NULL;
 static char quote = CSV_QUOTE;
-static int ignore_this = 0;
-
-typedef struct { unsigned int rcount; unsigned int fcount; char *record; } CSV_status;
+static __thread int ignore_this = 0;
+static unsigned int threads = 1;
+static int csv_full = 0;
+static size_t buffer_size = BUFFER_SIZE;
+static size_t record_buffer_size = RECORD_BUFFER_SIZE;
+static size_t dlen = 1;
+static int add_lnum = 0;
+static int add_fc = 0;
+static int add_offset = 0;
+static int nl_mode = 0;
+static int histogram = 0;
+static __thread hist fc_hist;   // Records per field count, with --histogram
+static int count_only = 0;      // --count: output how many records mismatch
+static uint64_t max_errors = 0; // -m: stop a file after this many (0: never)
+static __thread uint64_t mismatches = 0;  // Mismatching records in the current file
+static uint64_t rec_first = 1;  // --records: the first and last records wanted
+static uint64_t rec_last = UINT64_MAX;
+static char *index_in = NULL;   // --index: sidecar index to read
+static char *index_out = NULL;  // --write-index: sidecar index to write
+static recidx idx;              // The index read or being written
+static int byte_range = 0;      // --byte-range: only records starting in
+static size_t range_start = 0;  // [range_start, range_end) of each FILE
+static size_t range_end = SIZE_MAX;
+static int with_filename = 0;
+static int pipelined = 0;       // Streamed input is read and written by threads of their own
+static int use_uring = 0;       // --io-uring: regular FILEs are read with io_uring, not mapped
+static __thread const char *cur_file = NULL;  // The FILE being processed, for -H
+static __thread size_t cur_file_len = 0;
+static outbuf stdout_buf;
+static __thread outbuf *out = &stdout_buf;  // Where this thread's output goes
+
+// Per-parser state for CSV mode.  Records are only counted; the raw bytes of
+// a mismatching record are found again through the parser's row offsets,
+// either in the chunk being parsed or in the bytes kept from earlier chunks:
+typedef struct {
+    uint64_t rcount;        // Records seen
+    uint64_t fcount;        // Fields in the current record
+    uint64_t nlcount;       // Newlines inside the fields of the current record
+    struct csv_parser *p;   // The parser calling back
+    size_t row_start;       // Input offsets of the current record
+    size_t row_end;
+    char *buf;              // The chunk being parsed
+    size_t buf_off;         // Input offset of buf
+    char *carry;            // Unfinished record from earlier chunks
+    size_t carry_off;       // Input offset of carry
+    size_t carry_len;       // Bytes in carry (it ends where buf begins)
+    size_t carry_size;      // Allocated size for carry
+    int mapped;             // buf is a mapping of the whole file
+    uint64_t next_mark;     // rcount of the next --write-index checkpoint
+} CSV_status;
+
+// Line source for the plain-delimiter path: regular files are mapped and
+// scanned in place, anything else (stdin, pipes, or files with --io-uring)
+// is read in blocks of buffer_size bytes (ahead, by another thread if
+// pipelined, or with io_uring), so a longer line comes in several pieces:
+typedef struct {
+    FILE *fp;       // Streaming input, NULL when mapped
+    readahead ra;   // Blocks read from fp
+    char *buf;      // The current block, after what the last one left
+    size_t end;     // Bytes in buf
+    int eof;        // Nothing more to read from fp
+    int split;      // The last piece returned was not the end of its line
+    mmfile map;     // Mapped input
+    size_t pos;     // Offset of the next piece in map or buf
+    size_t dlen;    // Length of the delimiter
+    int nul_delim;  // Whether NULs (once replaced) can be part of a delimiter
+} Reader;
+
+// A mismatching record found by a worker thread:
+typedef struct {
+    char *line;             // Start of the record in the mapping
+    size_t len;             // Bytes in the record, newline included
+    uint64_t rnum;          // Record number within the chunk (1-based)
+    uint64_t fc;            // Field count
+    int has_nul;            // Whether the record contains NULs
+} Mismatch;
+
+// What counting a CSV chunk found, from one guess of the state at its start.
+// Offsets in csv_row are from the start of the mapping:
+typedef struct {
+    char *map;              // Start of the mapping
+    int quoted;             // Guessed to start inside a quoted field
+    uint64_t records;       // Records ended in the chunk
+    Mismatch *hits;         // Records that may be output, in file order
+    size_t nhits;
+    size_t hits_size;       // Allocated size for hits
+    int pending;            // What the chunk left unfinished (CSV_PENDING_*)
+    size_t fields;          // Fields ended in that unfinished record
+    size_t row_start;       // Where that record began
+    uint64_t bad;           // --count: mismatches not kept in hits
+    hist counts;            // --histogram: field counts of the records
+    hist *to;               // Where they go (counts, or the chunk's tail)
+    int failed;             // Out of memory while counting
+} CsvGuess;
+
+// A newline-aligned byte range of a mapped file, scanned by one thread:
+typedef struct {
+    char *start;
+    char *end;
+    uint64_t records;       // Records in the chunk
+    Mismatch *hits;         // Mismatching records, in file order
+    size_t nhits;
+    size_t hits_size;       // Allocated size for hits
+    uint64_t bad;           // --count: mismatches not kept in hits
+    CsvGuess guess[2];      // CSV: counted from between rows / inside quotes
+    int exact;              // Starts at a checkpoint of --index, between records
+    int converged;          // CSV: both guesses were between rows at one point
+    uint64_t conv_records;  // CSV: guess[0]'s records, hits and bad at that point
+    size_t conv_nhits;
+    uint64_t conv_bad;
+    hist counts;            // --histogram: field counts of the records (plain),
+                            // or of those after the guesses agreed (CSV)
+    int done;               // Set (under Pool.lock) once scanned
+    int failed;             // Out of memory while scanning
+} Chunk;
+
+// Work shared between the worker threads and the thread writing output.
+// Chunks are cut from the cursor as they're handed out, no more than window
+// of them ahead of the output, each in slot (its number % window):
+typedef struct {
+    Chunk *chunks;          // The slots
+    size_t window;
+    size_t next;            // Number of the next chunk to hand out
+    size_t written;         // Chunks the output is done with
+    char *cursor;           // Where the next chunk starts
+    char *end;              // Where the last one ends
+    size_t dlen;
+    int nul_delim;
+    int csv;                // Count CSV records instead of lines
+    int stop;               // Set to make the workers give up their chunks
+    char *map;              // Start of the mapping
+    size_t size;            // Bytes in the mapping
+    pthread_t *workers;
+    unsigned int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t done;    // A chunk was scanned
+    pthread_cond_t room;    // A slot was freed
+} Pool;
+
+// Bytes in a chunk, before moving its end to the next newline (or index
+// checkpoint).  Mismatches are kept until their chunk is output, so small
+// chunks, only POOL_AHEAD per thread handed out ahead of the output, bound
+// that memory by the number of threads rather than the size of the file:
+#define POOL_CHUNK_SIZE (1 << 19)
+#define POOL_AHEAD 2
+
+// Bytes both guesses of a CSV chunk are counted over before comparing them,
+// a small part of a chunk, as the guesses usually agree after the first:
+#define CSV_GUESS_STEP (1 << 16)
 
 static void try_help (int status) {
     printf("Try '%s --help' for more information.\n", program_name);
@@ -57,10 +224,61 @@ More than one FILE can be specified.\n\
   -n, --field-count=FC   the field count to use while processing (required)\n\
   -l, --add-line         include the line number in the output\n\
   -c, --add-count        include the field count in the output\n\
+      --add-offset       include the byte offset of the record in the output\n\
+  -H, --with-filename    include the FILE name in the output; with -t, the\n\
+                           output of each FILE comes as soon as it's done\n\
+                           instead of in command-line order\n\
   -C  --csv              parse CSV files\n\
   -Q, --csv-quote        CSV quoting character (ignored unless --csv)\n\
   -N, --csv-nl-count     output CSV records with embedded newlines\n\
+      --histogram        output how many records have each field count\n\
+                           instead of the records (-n isn't needed)\n\
+      --count            output how many records do NOT match instead of\n\
+                           the records\n\
+  -m, --max-errors=N     stop reading a FILE after N records NOT matching\n\
+      --records=A-B      only look at records A to B (also A-, -B or A)\n\
+      --write-index=FILE write an index of the one FILE read, with a\n\
+                           checkpoint every 65536 records\n\
+      --index=FILE       use an index from --write-index: --records start\n\
+                           at the nearest checkpoint, threads split the FILE\n\
+                           at checkpoints, and --count is answered from it\n\
+                           if neither the FILE nor the options changed,\n\
+                           reading only the --records before the first\n\
+                           checkpoint in them and after the last\n\
+      --byte-range=A:B   only look at the records starting from byte A up\n\
+                           to (not including) byte B of a regular FILE, or\n\
+                           to its end without B (a range past the end is\n\
+                           empty); K, M and G suffixes are accepted.\n\
+                           Offsets are output, and the records of\n\
+                           consecutive ranges add up to those of the FILE,\n\
+                           but -l numbers them from 1 in each range, and\n\
+                           --count and --histogram total each range alone\n\
+      --csv-full         run libcsv's full parser instead of only counting\n\
+                           fields (slower; for cross-checking)\n\
+      --buffer-size=SIZE read input that can't be mapped (e.g. stdin) SIZE\n\
+                           bytes at a time; K, M and G suffixes are accepted\n\
+                           (default 4M); with more than one CPU and at least\n\
+                           64K, input other than CSV is read ahead and the\n\
+                           output written behind by threads of their own\n\
+      --spill-after=SIZE keep up to SIZE bytes of a line longer than a\n\
+                           buffer in memory, and the rest in a temporary\n\
+                           file (default 64M)\n\
+      --io-uring         read regular FILEs with io_uring, several blocks\n\
+                           of --buffer-size at a time, instead of mapping\n\
+                           them (ignored with -t on one FILE, --index or\n\
+                           --byte-range, or without io_uring)\n\
+  -t, --threads=N        scan each regular FILE with N threads (ignored with\n\
+                           --csv-full, --records or --write-index); with\n\
+                           several FILEs, process N FILEs at a time, the\n\
+                           largest first, each with one thread\n\
   -h, --help             This help\n\
+");
+
+      printf ("\
+\n\
+With --count or -m, the exit status is 0 if every record matched, 1 if\n\
+some didn't, and 2 if a FILE was stopped after N of them (whether or not\n\
+anything was left to read).\n\
 ");
     }
 
@@ -68,19 +286,129 @@ More than one FILE can be specified.\n\
 }
 
 
+// Options without a short form:
+enum {
+    CSV_FULL_OPTION = CHAR_MAX + 1,
+    BUFFER_SIZE_OPTION,
+    ADD_OFFSET_OPTION,
+    SPILL_AFTER_OPTION,
+    HISTOGRAM_OPTION,
+    COUNT_OPTION,
+    RECORDS_OPTION,
+    INDEX_OPTION,
+    WRITE_INDEX_OPTION,
+    BYTE_RANGE_OPTION,
+    IO_URING_OPTION
+};
+
 static struct option long_options[] = {
     {"delimiter",   required_argument, 0, 'd'},
     {"field-count", required_argument, 0, 'n'},
     {"add-line",    no_argument      , 0, 'l'},
     {"add-count",   no_argument      , 0, 'c'},
+    {"add-offset",  no_argument      , 0, ADD_OFFSET_OPTION},
+    {"with-filename", no_argument    , 0, 'H'},
     {"csv",         no_argument      , 0, 'C'},
     {"csv-quote",   required_argument, 0, 'Q'},
     {"csv-nl-count",no_argument      , 0, 'N'},
+    {"histogram",   no_argument      , 0, HISTOGRAM_OPTION},
+    {"count",       no_argument      , 0, COUNT_OPTION},
+    {"max-errors",  required_argument, 0, 'm'},
+    {"records",     required_argument, 0, RECORDS_OPTION},
+    {"index",       required_argument, 0, INDEX_OPTION},
+    {"write-index", required_argument, 0, WRITE_INDEX_OPTION},
+    {"byte-range",  required_argument, 0, BYTE_RANGE_OPTION},
+    {"threads",     required_argument, 0, 't'},
+    {"csv-full",    no_argument      , 0, CSV_FULL_OPTION},
+    {"buffer-size", required_argument, 0, BUFFER_SIZE_OPTION},
+    {"spill-after", required_argument, 0, SPILL_AFTER_OPTION},
+    {"io-uring",    no_argument      , 0, IO_URING_OPTION},
     {"help",        no_argument      , 0, 'h'},
     {0, 0, 0, 0}
 };
 
 
+/* Parse a positive whole number, nothing else: no sign, spaces or suffix */
+static int parse_count(const char *s, unsigned long long *n)
+{
+    char *end = NULL;
+
+    if (s[0] < '0' || s[0] > '9') return -1;
+    errno = 0;
+    *n = strtoull(s, &end, 10);
+    return (errno != 0 || *end != '\0' || *n == 0) ? -1 : 0;
+}
+
+/* Parse a byte count with an optional K, M or G (binary) suffix */
+static int parse_size(const char *s, size_t *size)
+{
+    char *end = NULL;
+    unsigned long long n = 0;
+    int shift = 0;
+
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if (errno != 0 || end == s || s[0] == '-') return -1;
+
+    switch (*end) {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' || n > (SIZE_MAX >> shift)) return -1;
+
+    *size = (size_t)n << shift;
+    return 0;
+}
+
+/* Parse a --records range: A-B, A- (to the end), -B, or just A */
+static int parse_records(const char *s, uint64_t *first, uint64_t *last)
+{
+    char *end = NULL;
+
+    *first = 1;
+    *last = UINT64_MAX;
+
+    if (s[0] != '-') {
+        errno = 0;
+        *first = strtoull(s, &end, 10);
+        if (errno != 0 || end == s || *first == 0) return -1;
+        s = end;
+        if (*s == '\0') {
+            *last = *first;
+            return 0;
+        }
+    }
+    if (*s++ != '-') return -1;
+    if (*s != '\0') {
+        errno = 0;
+        *last = strtoull(s, &end, 10);
+        if (errno != 0 || end == s || *end != '\0' || s[0] == '-') return -1;
+    }
+
+    return (*first <= *last) ? 0 : -1;
+}
+
+/* Parse a --byte-range: START:END, or START: to the end of the file */
+static int parse_byte_range(const char *s, size_t *start, size_t *end)
+{
+    const char *colon = strchr(s, ':');
+    char *first = NULL;
+    int rc = -1;
+
+    if (colon == NULL) return -1;
+    first = strndup(s, colon - s);
+    if (first == NULL) return -1;
+
+    *end = SIZE_MAX;
+    if (parse_size(first, start) == 0 && (colon[1] == '\0' || parse_size(colon + 1, end) == 0)) {
+        rc = (*start <= *end) ? 0 : -1;
+    }
+
+    free(first);
+    return rc;
+}
+
 static void replace_nulls(char *line, ssize_t bytes_read)
 {
     for (ssize_t i = 0; i < bytes_read; i++) {
@@ -88,101 +416,1354 @@ static void replace_nulls(char *line, ssize_t bytes_read)
     }
 }
 
-static unsigned int newline_count(char *line)
+static uint64_t newline_count(const char *line, size_t len)
 {
-    unsigned int retval = 0;
-    for (size_t i = 0; i < strlen(line); i++) {
-        if ( line[i] == 10 ) { retval++; }
+    uint64_t retval = 0;
+    const char *end = line + len;
+    while ((line = memchr(line, '\n', end - line)) != NULL) {
+        retval++;
+        line++;
     }
     return retval;
 }
 
 
-/* Return the number of delimiters in a string */
-static unsigned int dcount(char *line, char *delim, const int dlen, ssize_t bytes_read)
+/* Open filename for line-by-line reading, mapping it when possible */
+static int reader_open(Reader *r, char *filename)
+{
+    int rc = 1;
+
+    r->fp = NULL;
+    r->buf = NULL;
+    r->end = 0;
+    r->eof = 0;
+    r->split = 0;
+    r->pos = 0;
+    r->dlen = dlen;
+    r->nul_delim = (strchr(delim, NUL_REPLACEMENT_CHARACTER) != NULL);
+
+    if (filename[0] != '-' && !use_uring) {
+        rc = mmfile_open(&r->map, filename);
+        check_debug(rc != -1, "Error mapping file: %s.", filename);
+    }
+
+    if (rc == 1) {
+        r->fp = (filename[0] == '-') ? stdin : fopen(filename, "rb");
+        check(r->fp != NULL, "Error opening file: %s.", filename);
+        // Room for more than a cut-off delimiter, so every block makes
+        // progress, and for one before it, left from the last block:
+        size_t size = (buffer_size > 2 * r->dlen) ? buffer_size : 2 * r->dlen;
+        int how = (pipelined ? READAHEAD_THREAD : 0) | (use_uring ? READAHEAD_URING : 0);
+        check_debug(readahead_start(&r->ra, r->fp, size, r->dlen, how) == 0,
+                    "Error reading file: %s.", filename);
+    }
+
+    return 0;
+
+error:
+    return -1;
+}
+
+/* Scan the record (or the part of it) starting at start into *rec */
+static void reader_scan(Reader *r, char *start, char *end, scan_rec *rec)
+{
+    // One pass finds the end of the line, its delimiters and any NULs:
+    scan_record(start, end, delim, r->dlen, rec);
+
+    // NULs are counted as the '?' they're output as, if the delimiter has one:
+    if (rec->has_nul && r->nul_delim) {
+        scan_record_nul_as(start, end, delim, r->dlen, NUL_REPLACEMENT_CHARACTER, rec);
+    }
+}
+
+/*
+   Point *piece at the next line (newline included) and scan it into *rec.
+   A line longer than a block of streamed input comes in several pieces;
+   *more is set for all but the last.  Returns the length of the piece, or
+   -1 at EOF.
+*/
+static ssize_t reader_next(Reader *r, char **piece, scan_rec *rec, int *more)
+{
+    char *start = NULL;
+
+    *more = 0;
+
+    if (r->fp == NULL) {
+        if (r->pos >= r->map.size) return -1;
+        start = r->map.data + r->pos;
+        reader_scan(r, start, r->map.data + r->map.size, rec);
+        r->pos += rec->len;
+        *piece = start;
+        return (ssize_t)rec->len;
+    }
+
+    while (1) {
+        if (r->pos < r->end) {
+            start = r->buf + r->pos;
+            reader_scan(r, start, r->buf + r->end, rec);
+            *more = (start[rec->len - 1] != '\n' && !r->eof);
+            if (*more) {
+                // The line goes on; what may begin a cut-off delimiter is
+                // scanned again with the next block:
+                rec->len -= rec->open;
+            }
+            if (rec->len > 0) {
+                r->pos += rec->len;
+                r->split = *more;
+                *piece = start;
+                return (ssize_t)rec->len;
+            }
+        }
+        if (r->eof) {
+            if (!r->split) return -1;
+            // End the line the last piece left unfinished:
+            memset(rec, 0, sizeof(*rec));
+            r->split = 0;
+            *piece = r->buf;
+            return 0;
+        }
+
+        // Move on to the next block, with what's left of this one:
+        size_t n = readahead_next(&r->ra, r->buf + r->pos, r->end - r->pos, &r->buf);
+        // A read failed; what's left is no line at all (the caller reports it):
+        if (n == 0 && r->ra.error) return -1;
+        r->eof = (n == 0);
+        r->end = r->end - r->pos + n;
+        r->pos = 0;
+    }
+}
+
+static void reader_close(Reader *r)
+{
+    if (r->fp != NULL) {
+        readahead_stop(&r->ra);
+        fclose(r->fp);
+    }
+    else {
+        mmfile_close(&r->map);
+    }
+}
+
+
+/* Write a "[name:n]" prefix followed by the separator */
+static void emit_tag(const char *name, unsigned long long n, const char *sep, size_t seplen)
+{
+    outbuf_putc(out, '[');
+    outbuf_write(out, name, strlen(name));
+    outbuf_putc(out, ':');
+    outbuf_putu(out, n);
+    outbuf_putc(out, ']');
+    outbuf_write(out, sep, seplen);
+}
+
+// Whether -m mismatches have been found in the current file:
+static inline int enough_errors(void)
+{
+    return max_errors && mismatches >= max_errors;
+}
+
+// Count n more mismatches, no more than -m asks for:
+static void add_mismatches(uint64_t n)
+{
+    mismatches += n;
+    if (max_errors && mismatches > max_errors) {
+        mismatches = max_errors;
+    }
+}
+
+// Write the name of the FILE being processed, with -H:
+static void emit_file_tag(const char *sep, size_t seplen)
+{
+    outbuf_write(out, "[file:", 6);
+    outbuf_write(out, cur_file, cur_file_len);
+    outbuf_putc(out, ']');
+    outbuf_write(out, sep, seplen);
+}
+
+/*
+   Write a record NOT matching fieldcount, prefixed with its record number,
+   byte offset and/or field count as requested.  Records in a mapped file are
+   referenced rather than copied; the mapping must outlive the next
+   outbuf_flush().
+*/
+static void emit_prefix(uint64_t lnum, uint64_t offset, uint64_t fc)
+{
+    if (with_filename) { emit_file_tag(delim, dlen); }
+    if (add_lnum) { emit_tag("rec", lnum, delim, dlen); }
+    if (add_offset) { emit_tag("offset", offset, delim, dlen); }
+    if (add_fc) { emit_tag("fields", fc, delim, dlen); }
+}
+
+/*
+   Write n bytes at s, referenced if they're in a mapped file, with any NULs
+   replaced on the way (the mapping is read-only).
+*/
+static void emit_bytes(const char *s, size_t n, int mapped)
+{
+    const char *end = s + n;
+    const char *nul = NULL;
+
+    while (s < end) {
+        nul = memchr(s, 0, end - s);
+        size_t len = (nul ? nul : end) - s;
+        if (mapped) {
+            outbuf_ref(out, s, len);
+        }
+        else {
+            outbuf_write(out, s, len);
+        }
+        if (nul == NULL) break;
+        outbuf_putc(out, NUL_REPLACEMENT_CHARACTER);
+        s = nul + 1;
+    }
+}
+
+static void emit_record(const char *line, size_t len, uint64_t lnum, uint64_t offset, uint64_t fc,
+                        int has_nul, int mapped)
+{
+    emit_prefix(lnum, offset, fc);
+
+    if (has_nul) {
+        emit_bytes(line, len, mapped);
+    }
+    else if (mapped) {
+        outbuf_ref(out, line, len);
+    }
+    else {
+        outbuf_write(out, line, len);
+    }
+}
+
+/* Whether filename is a regular file of no bytes, e.g. for --byte-range */
+static int empty_file(const char *filename)
+{
+    struct stat st;
+
+    return filename[0] != '-' && stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0;
+}
+
+/*
+   Where the first line starting at or after offset of a mapped file starts
+   (the size of the file if none does).  A --byte-range bound is moved
+   there, so consecutive ranges split the file between lines.
+*/
+static size_t line_boundary(const mmfile *map, size_t offset)
+{
+    if (offset == 0) return 0;
+    if (offset >= map->size) return map->size;
+
+    char *nl = memchr(map->data + offset - 1, '\n', map->size - offset + 1);
+    return nl ? (size_t)(nl + 1 - map->data) : map->size;
+}
+
+/*
+   Process a regular delimited file.
+   Output records NOT matching fieldcount.
+
+   A line read in several pieces is kept (in memory up to
+   record_buffer_size bytes, then in a temporary file) until its field
+   count is known.  Once it has more fields than fieldcount it can't match,
+   so unless the count is to be output it's written out as it comes instead.
+*/
+static int ncount(char *filename)
+{
+    char *line = NULL;
+    Reader r;
+    int opened = 0;         // whether r needs closing
+    writebehind wb;         // output thread for streamed input
+    int behind = 0;         // whether out is wb.out
+    spill pieces;           // earlier pieces of a line read in several
+    ssize_t bytes_read = 0; // num of chars read
+    scan_rec rec;           // what scanning the line found
+    int more = 0;           // whether the line goes on in the next piece
+    int split = 0;          // whether line is a later piece of a line
+    int direct = 0;         // whether that line is being written as it comes
+    uint64_t delims = 0;    // delimiters in the pieces so far
+    uint64_t len = 0;       // bytes in the pieces so far
+    uint64_t lnum = 0;
+    uint64_t offset = 0;    // where the line starts in the input
+    uint64_t next_mark = index_out ? 0 : UINT64_MAX;  // lnum of the next index checkpoint
+    uint64_t stop = UINT64_MAX;                       // where --byte-range ends
+
+    spill_init(&pieces, record_buffer_size);
+    check_debug(reader_open(&r, filename) == 0, "Error opening file: %s.", filename);
+    opened = 1;
+
+    if (r.fp != NULL && pipelined) {
+        // Streamed input is read by one thread, scanned by this one, and
+        // the output written by a third:
+        check_debug(writebehind_start(&wb, out) == 0, "Error starting output: %s.", filename);
+        out = &wb.out;
+        behind = 1;
+    }
+
+    if (byte_range && r.fp != NULL) {
+        // Only an empty file isn't mapped, and any range of it is empty:
+        check(empty_file(filename), "ERROR: --byte-range needs a regular file: %s", filename);
+        stop = 0;
+    }
+    else if (byte_range) {
+        r.pos = offset = line_boundary(&r.map, range_start);
+        stop = line_boundary(&r.map, range_end);
+    }
+
+    if (index_in != NULL && r.fp == NULL) {
+        // Start from the last checkpoint before the first record wanted:
+        const recidx_mark *m = recidx_find(&idx, rec_first);
+        if (m != NULL) {
+            r.pos = m->offset;
+            lnum = m->rnum;
+            offset = m->offset;
+        }
+    }
+
+    while ((bytes_read = reader_next(&r, &line, &rec, &more)) != -1) {
+
+        if (!split) {
+            // A line starts here:
+            if (lnum >= rec_last || offset >= stop) break;
+            if (lnum == next_mark) {
+                recidx_add(&idx, lnum, offset, mismatches);
+                next_mark += idx.step;
+            }
+        }
+
+        if (lnum + 1 < rec_first || histogram || count_only) {
+            // Only the field count matters, however many pieces there are:
+            delims += rec.delims;
+            len += bytes_read;
+            split = more;
+            if (more) continue;
+            lnum++;
+            if (lnum < rec_first) {
+                // Before --records
+            }
+            else if (histogram) {
+                hist_add(&fc_hist, delims + 1, 1);
+            }
+            else if ( fieldcount != (delims + 1) ) {
+                mismatches++;
+                if (enough_errors()) break;
+            }
+            offset += len;
+            delims = len = 0;
+            continue;
+        }
+
+        if (!more && !split) {
+            lnum++;
+            if ( fieldcount != (rec.delims + 1) ) {
+                emit_record(line, bytes_read, lnum, offset, rec.delims + 1, rec.has_nul, r.fp == NULL);
+                mismatches++;
+                if (enough_errors()) break;
+            }
+            offset += bytes_read;
+            continue;
+        }
+
+        delims += rec.delims;
+        len += bytes_read;
+        if (rec.has_nul) { replace_nulls(line, bytes_read); }
+
+        if (!direct && !add_fc && fieldcount < delims + 1) {
+            // Output the pieces so far, and the rest as it's read:
+            emit_prefix(lnum + 1, offset, 0);
+            check(spill_write(&pieces, out) == 0, "Error writing out a long line.");
+            mismatches++;
+            direct = 1;
+        }
+        if (direct) {
+            outbuf_write(out, line, bytes_read);
+        }
+        else {
+            check(spill_add(&pieces, line, bytes_read) == 0, "Error keeping a long line.");
+        }
+
+        if (!more) {
+            lnum++;
+            if ( !direct && fieldcount != (delims + 1) ) {
+                emit_prefix(lnum, offset, delims + 1);
+                check(spill_write(&pieces, out) == 0, "Error writing out a long line.");
+                mismatches++;
+            }
+            offset += len;
+            spill_reset(&pieces);
+            split = direct = 0;
+            delims = len = 0;
+            if (enough_errors()) break;
+        }
+        else {
+            split = 1;
+        }
+    }
+    check(r.fp == NULL || r.ra.error == 0, "Error reading file: %s: %s.", filename, strerror(r.ra.error));
+
+    if (index_out != NULL) {
+        idx.records = lnum;
+        idx.mismatches = mismatches;
+    }
+
+    // Records may still be referenced from the mapping:
+    outbuf_flush(out);
+    if (behind) {
+        writebehind_finish(&wb);
+        out = wb.to;
+    }
+    reader_close(&r);
+    spill_free(&pieces);
+
+    return 0;
+
+error:
+    if (behind) {
+        writebehind_finish(&wb);
+        out = wb.to;
+    }
+    if (opened) reader_close(&r);
+    spill_free(&pieces);
+    return -1;
+}
+
+/* Make room for one more hit, returning NULL when out of memory */
+static Mismatch *add_hit(Mismatch **hits, size_t *nhits, size_t *hits_size)
+{
+    if (*nhits == *hits_size) {
+        size_t size = *hits_size ? *hits_size * 2 : 64;
+        Mismatch *grown = realloc(*hits, size * sizeof(Mismatch));
+        if (grown == NULL) return NULL;
+        *hits = grown;
+        *hits_size = size;
+    }
+    return &(*hits)[(*nhits)++];
+}
+
+/* Scan one chunk, collecting the records NOT matching fieldcount */
+static void scan_chunk(Pool *pool, Chunk *ch)
+{
+    char *p = ch->start;
+    scan_rec rec;
+
+    while (p < ch->end && !__atomic_load_n(&pool->stop, __ATOMIC_RELAXED)) {
+        scan_record(p, ch->end, delim, pool->dlen, &rec);
+        if (rec.has_nul && pool->nul_delim) {
+            scan_record_nul_as(p, ch->end, delim, pool->dlen, NUL_REPLACEMENT_CHARACTER, &rec);
+        }
+        ch->records++;
+
+        if (histogram) {
+            hist_add(&ch->counts, rec.delims + 1, 1);
+        }
+        else if ( fieldcount != (rec.delims + 1) ) {
+            if (count_only) {
+                ch->bad++;
+            }
+            else {
+                Mismatch *m = add_hit(&ch->hits, &ch->nhits, &ch->hits_size);
+                if (m == NULL) { ch->failed = 1; return; }
+                m->line = p;
+                m->len = rec.len;
+                m->rnum = ch->records;
+                m->fc = rec.delims + 1;
+                m->has_nul = rec.has_nul;
+            }
+            // The rest of the file won't be output:
+            if (max_errors && ch->nhits + ch->bad >= max_errors) return;
+        }
+        p += rec.len;
+    }
+}
+
+/*
+   Set up a CSV parser for the dialect given on the command line.  Its
+   buffers come from the thread's pool, so they are reused by the parser
+   of the next file or chunk.
+*/
+static int csv_setup(struct csv_parser *p)
+{
+    // cb1 only counts fields, so they never need copying out of the input:
+    if (csv_init(p, CSV_ZERO_COPY) != 0) return -1;
+
+    csv_set_delim(p, delim_csv);
+    csv_set_quote(p, quote);
+    csv_set_realloc_func(p, bufpool_realloc);
+    csv_set_free_func(p, bufpool_free);
+
+    return 0;
+}
+
+/*
+   Row callback for CSV chunks.  Keeps the records that may be output; the
+   first one of a chunk guessed to start inside quotes is always kept, as
+   it ends a record begun in an earlier chunk.
+*/
+static void csv_chunk_row(const struct csv_row *row, void *data)
+{
+    CsvGuess *g = (CsvGuess *)data;
+    char *line = g->map + row->start;
+    size_t len = row->end - row->start;
+
+    g->records++;
+    if (!(g->quoted && g->records == 1)) {
+        if (histogram) {
+            hist_add(g->to, row->fields, 1);
+            return;
+        }
+        if (nl_mode ? row->newlines == 0 : fieldcount == row->fields) return;
+        if (count_only) {
+            g->bad++;
+            return;
+        }
+    }
+
+    Mismatch *m = add_hit(&g->hits, &g->nhits, &g->hits_size);
+    if (m == NULL) { g->failed = 1; return; }
+    m->line = line;
+    m->len = len;
+    m->rnum = g->records;
+    m->fc = row->fields;
+    m->has_nul = 0;
+}
+
+/*
+   Whether a CSV chunk holds more than -m mismatches under either guess
+   (one of which may be the end of an earlier record), so the rest of it
+   won't be output.  After the guesses agreed, guess[0] counts for both.
+*/
+static int csv_chunk_enough(const Chunk *ch)
+{
+    const CsvGuess *g0 = &ch->guess[0];
+    const CsvGuess *g1 = &ch->guess[1];
+    uint64_t found0 = g0->nhits + g0->bad;
+    uint64_t found1 = g1->nhits + g1->bad;
+
+    if (ch->exact) {
+        found1 = found0;
+    }
+    else if (ch->converged) {
+        found1 += found0 - ch->conv_nhits - ch->conv_bad;
+    }
+    return max_errors && found0 > max_errors && found1 > max_errors;
+}
+
+/*
+   Count the records of a CSV chunk.  A chunk starts after a newline, so it
+   starts either between records or inside a quoted field; both are counted
+   until they agree (both between records at the same point), after which
+   the rest of the chunk only needs counting once.  A chunk starting at an
+   index checkpoint is known to start between records.
+*/
+static void scan_csv_chunk(Pool *pool, Chunk *ch)
+{
+    struct csv_parser p[2];
+    size_t len = ch->end - ch->start;
+    int nguess = ch->exact ? 1 : 2;
+    int ready = 0;          // Parsers initialized
+    int live = nguess;      // Guesses still being counted
+
+    for (ready = 0; ready < nguess; ready++) {
+        CsvGuess *g = &ch->guess[ready];
+        if (csv_setup(&p[ready]) != 0) { ch->failed = 1; goto done; }
+        csv_count_start(&p[ready], ch->start - pool->map, ready);
+        g->map = pool->map;
+        g->quoted = ready;
+        g->to = &g->counts;
+    }
+
+    for (size_t pos = 0; pos < len && !ch->failed; pos += CSV_GUESS_STEP) {
+        if (__atomic_load_n(&pool->stop, __ATOMIC_RELAXED) || csv_chunk_enough(ch)) break;
+        size_t n = (len - pos < CSV_GUESS_STEP) ? len - pos : CSV_GUESS_STEP;
+        for (int i = 0; i < live; i++) {
+            if (csv_count(&p[i], ch->start + pos, n, csv_chunk_row, &ch->guess[i]) != n) ch->failed = 1;
+            ch->failed |= ch->guess[i].failed;
+        }
+        if (live == 2 && csv_count_pending(&p[0], NULL) == CSV_PENDING_NONE
+                && csv_count_pending(&p[1], NULL) == CSV_PENDING_NONE) {
+            live = 1;
+            ch->converged = 1;
+            ch->conv_records = ch->guess[0].records;
+            ch->conv_nhits = ch->guess[0].nhits;
+            ch->conv_bad = ch->guess[0].bad;
+            ch->guess[0].to = &ch->counts;
+        }
+    }
+
+    for (int i = 0; i < nguess; i++) {
+        CsvGuess *g = &ch->guess[i];
+        size_t end;
+        g->pending = csv_count_pending(&p[i], &g->fields);
+        csv_get_row_span(&p[i], &g->row_start, &end);
+    }
+
+done:
+    while (ready-- > 0) csv_free(&p[ready]);
+}
+
+// Where records start after a --byte-range bound, under one guess:
+typedef struct {
+    size_t *starts;
+    size_t n;
+    size_t size;            // Allocated size for starts
+    size_t skip;            // A row starting here is the end of an earlier one
+    int failed;             // Out of memory
+} RowStarts;
+
+static void csv_resolve_row(const struct csv_row *row, void *data)
+{
+    RowStarts *rs = (RowStarts *)data;
+
+    if (row->start == rs->skip) return;
+    if (rs->n == rs->size) {
+        size_t size = rs->size ? rs->size * 2 : 1024;
+        size_t *grown = realloc(rs->starts, size * sizeof(size_t));
+        if (grown == NULL) { rs->failed = 1; return; }
+        rs->starts = grown;
+        rs->size = size;
+    }
+    rs->starts[rs->n++] = row->start;
+}
+
+/*
+   Where the first CSV record starting at or after offset of a mapped file
+   starts, as far as can be told without reading what comes before.  The
+   line after offset starts either between records or inside a quoted
+   field; both are counted until a record starts at the same place under
+   each, which is then a record boundary either way.  Returns -1 if none
+   is found within CSV_RESOLVE_LIMIT bytes.
+*/
+static int csv_boundary(const mmfile *map, size_t offset, size_t *at)
+{
+    struct csv_parser p[2];
+    size_t from = line_boundary(map, offset);
+    size_t pos = from;
+    size_t i[2] = {0, 0};   // Row starts of each guess already compared
+    RowStarts rs[2] = { {NULL, 0, 0, SIZE_MAX, 0}, {NULL, 0, 0, from, 0} };
+    int ready = 0;          // Parsers initialized
+    int rc = -1;
+
+    *at = from;
+    if (from == 0 || from == map->size) return 0;
+
+    for (ready = 0; ready < 2; ready++) {
+        if (csv_setup(&p[ready]) != 0) goto done;
+        csv_count_start(&p[ready], from, ready);
+    }
+
+    while (1) {
+        // Both lists are in increasing order, so a merge finds the first match:
+        while (i[0] < rs[0].n && i[1] < rs[1].n) {
+            size_t a = rs[0].starts[i[0]];
+            size_t b = rs[1].starts[i[1]];
+            if (a == b) {
+                *at = a;
+                rc = 0;
+                goto done;
+            }
+            i[a > b]++;
+        }
+        if (pos == map->size) {
+            // No record starts after here under both; the last range gets it all:
+            *at = map->size;
+            rc = 0;
+            goto done;
+        }
+        if (pos - from >= CSV_RESOLVE_LIMIT) goto done;
+
+        size_t n = (map->size - pos < CSV_GUESS_STEP) ? map->size - pos : CSV_GUESS_STEP;
+        for (int k = 0; k < 2; k++) {
+            if (csv_count(&p[k], map->data + pos, n, csv_resolve_row, &rs[k]) != n || rs[k].failed) goto done;
+        }
+        pos += n;
+    }
+
+done:
+    while (ready-- > 0) csv_free(&p[ready]);
+    free(rs[0].starts);
+    free(rs[1].starts);
+    return rc;
+}
+
+/* The records of a mapped CSV file --byte-range asks for, as [*from, *to) */
+static int csv_window(const mmfile *map, size_t *from, size_t *to)
+{
+    *from = 0;
+    *to = map->size;
+    if (!byte_range) return 0;
+
+    check(csv_boundary(map, range_start, from) == 0 && csv_boundary(map, range_end, to) == 0,
+          "ERROR: Can't tell where CSV records start near --byte-range %zu:%zu", range_start, range_end);
+    if (*to < *from) *to = *from;
+    return 0;
+
+error:
+    return -1;
+}
+
+/* The first checkpoint of --index at or after offset, or size if none */
+static size_t index_boundary(size_t offset, size_t size)
+{
+    size_t lo = 0;
+    size_t hi = idx.nmarks;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx.marks[mid].offset < offset) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return (lo < idx.nmarks) ? idx.marks[lo].offset : size;
+}
+
+/* Empty a slot for its next chunk, keeping the room it has for hits */
+static void chunk_reset(Chunk *ch)
+{
+    Chunk old = *ch;
+
+    hist_free(&ch->counts);
+    hist_free(&ch->guess[0].counts);
+    hist_free(&ch->guess[1].counts);
+    memset(ch, 0, sizeof(*ch));
+    ch->hits = old.hits;
+    ch->hits_size = old.hits_size;
+    for (int i = 0; i < 2; i++) {
+        ch->guess[i].hits = old.guess[i].hits;
+        ch->guess[i].hits_size = old.guess[i].hits_size;
+    }
+}
+
+/*
+   Hand out the next chunk: POOL_CHUNK_SIZE bytes from the cursor, up to
+   the next newline, or with --index the next checkpoint, which is known to
+   be between records too.  Waits while window chunks are ahead of the
+   output; returns NULL once there are none left.
+*/
+static Chunk *pool_next(Pool *pool)
+{
+    Chunk *ch = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop && pool->cursor < pool->end && pool->next - pool->written >= pool->window) {
+        pthread_cond_wait(&pool->room, &pool->lock);
+    }
+
+    if (!pool->stop && pool->cursor < pool->end) {
+        char *start = pool->cursor;
+        char *split = ((size_t)(pool->end - start) > POOL_CHUNK_SIZE) ? start + POOL_CHUNK_SIZE : pool->end;
+        if (split < pool->end && index_in != NULL) {
+            split = pool->map + index_boundary(split - pool->map, pool->size);
+            if (split > pool->end) split = pool->end;
+        }
+        else if (split < pool->end) {
+            char *nl = memchr(split - 1, '\n', pool->end - split + 1);
+            split = nl ? nl + 1 : pool->end;
+        }
+
+        ch = &pool->chunks[pool->next % pool->window];
+        chunk_reset(ch);
+        ch->start = start;
+        ch->end = split;
+        ch->exact = (index_in != NULL || pool->next == 0);
+        pool->cursor = split;
+        pool->next++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return ch;
+}
+
+static void *scan_worker(void *arg)
+{
+    Pool *pool = (Pool *)arg;
+    Chunk *ch = NULL;
+
+    while ((ch = pool_next(pool)) != NULL) {
+        if (pool->csv) {
+            scan_csv_chunk(pool, ch);
+        }
+        else {
+            scan_chunk(pool, ch);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        ch->done = 1;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    bufpool_drain();
+    return NULL;
+}
+
+/*
+   Start the worker threads on bytes [from, to) of a mapped file, from and
+   to being between records.  The pool must be zeroed, with csv set.
+*/
+static int pool_start(Pool *pool, mmfile *map, size_t from, size_t to)
+{
+    pool->window = (size_t)threads * POOL_AHEAD;
+    pool->chunks = calloc(pool->window, sizeof(Chunk));
+    check_mem(pool->chunks);
+    pool->cursor = map->data + from;
+    pool->end = map->data + to;
+    pool->dlen = dlen;
+    pool->nul_delim = (strchr(delim, NUL_REPLACEMENT_CHARACTER) != NULL);
+    pool->map = map->data;
+    pool->size = map->size;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_cond_init(&pool->room, NULL);
+
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    check_mem(pool->workers);
+    for (; pool->nworkers < threads; pool->nworkers++) {
+        check(pthread_create(&pool->workers[pool->nworkers], NULL, scan_worker, pool) == 0, "Error starting thread.");
+    }
+
+    return 0;
+
+error:
+    return -1;
+}
+
+/* Wait until chunk i has been scanned.  Returns NULL if there's no chunk i */
+static Chunk *pool_wait(Pool *pool, size_t i)
+{
+    Chunk *ch = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        if (i < pool->next && pool->chunks[i % pool->window].done) {
+            ch = &pool->chunks[i % pool->window];
+            break;
+        }
+        if (i >= pool->next && pool->cursor >= pool->end) break;
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return ch;
+}
+
+/* Chunk i has been output; its slot can take another */
+static void pool_release(Pool *pool, size_t i)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->written = i + 1;
+    pthread_cond_broadcast(&pool->room);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Let the workers finish the chunks handed out, then free the pool */
+static void pool_stop(Pool *pool)
+{
+    if (pool->chunks) {
+        // Whatever is left unscanned after an error (or -m) is skipped:
+        pthread_mutex_lock(&pool->lock);
+        __atomic_store_n(&pool->stop, 1, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&pool->room);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    for (unsigned int t = 0; t < pool->nworkers; t++) {
+        pthread_join(pool->workers[t], NULL);
+    }
+
+    if (pool->chunks) {
+        for (size_t i = 0; i < pool->window; i++) {
+            free(pool->chunks[i].hits);
+            free(pool->chunks[i].guess[0].hits);
+            free(pool->chunks[i].guess[1].hits);
+            hist_free(&pool->chunks[i].counts);
+            hist_free(&pool->chunks[i].guess[0].counts);
+            hist_free(&pool->chunks[i].guess[1].counts);
+        }
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->room);
+    }
+    free(pool->workers);
+    free(pool->chunks);
+}
+
+/*
+   Version that splits a mapped file into newline-aligned chunks scanned by
+   worker threads.  Chunks are written out in file order as they complete;
+   record numbers are the running sum of the records in earlier chunks.
+*/
+static int ncount_threads(char *filename)
+{
+    mmfile map;
+    Pool pool = {0};
+    uint64_t lnum = 0;      // records in the chunks already written
+    int failed = 0;
+
+    int rc = mmfile_open(&map, filename);
+    check_debug(rc != -1, "Error mapping file: %s.", filename);
+    if (rc == 1) {
+        // Not mapped (e.g. not a regular file), so there's nothing to split:
+        return ncount(filename);
+    }
+
+    if (byte_range) {
+        rc = pool_start(&pool, &map, line_boundary(&map, range_start), line_boundary(&map, range_end));
+    }
+    else {
+        rc = pool_start(&pool, &map, 0, map.size);
+    }
+
+    Chunk *ch = NULL;
+    for (size_t i = 0; rc == 0 && (ch = pool_wait(&pool, i)) != NULL; i++) {
+        failed |= ch->failed;
+        for (size_t k = 0; k < ch->nhits && !failed && !enough_errors(); k++) {
+            Mismatch *m = &ch->hits[k];
+            emit_record(m->line, m->len, lnum + m->rnum, m->line - map.data, m->fc, m->has_nul, 1);
+            mismatches++;
+        }
+        add_mismatches(ch->bad);
+        hist_merge(&fc_hist, &ch->counts);
+        lnum += ch->records;
+        pool_release(&pool, i);
+        if (enough_errors()) break;
+    }
+
+    pool_stop(&pool);
+    outbuf_flush(out);
+    mmfile_close(&map);
+
+    check(rc == 0, "Error scanning file: %s.", filename);
+    check(!failed, "Out of memory.");
+
+    return 0;
+
+error:
+    return -1;
+}
+
+// Callback 1 for CSV support, called whenever a field is processed:
+void cb1 (void *s, size_t len, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    csv_track->fcount++;
+    if (nl_mode) {
+        csv_track->nlcount += newline_count(s, len);
+    }
+}
+
+/*
+   Find the raw bytes of the record being submitted: up to two spans, the
+   part kept in carry from earlier chunks and the part in the current one.
+*/
+static void csv_record_spans(CSV_status *csv_track, char **a, size_t *alen, char **b, size_t *blen)
+{
+    size_t start = csv_track->row_start;
+    size_t end = csv_track->row_end;
+
+    if (start >= csv_track->buf_off) {
+        *a = csv_track->buf + (start - csv_track->buf_off);
+        *alen = end - start;
+        *b = NULL;
+        *blen = 0;
+    }
+    else {
+        *a = csv_track->carry + (start - csv_track->carry_off);
+        *alen = csv_track->buf_off - start;
+        *b = csv_track->buf;
+        *blen = end - csv_track->buf_off;
+    }
+}
+
+// Write the raw bytes of a CSV record and a newline:
+static void emit_csv_record(CSV_status *csv_track)
+{
+    char *a, *b;
+    size_t alen, blen;
+
+    csv_record_spans(csv_track, &a, &alen, &b, &blen);
+    emit_bytes(a, alen, csv_track->mapped);
+    if (blen > 0) {
+        emit_bytes(b, blen, 0);
+    }
+    outbuf_putc(out, '\n');
+    mismatches++;
+}
+
+// Write the byte offset of a CSV record, if asked for:
+static void emit_csv_offset(CSV_status *csv_track)
+{
+    if (add_offset) {
+        emit_tag("offset", csv_track->row_start, &delim_csv, 1);
+    }
+}
+
+// A function pointer to one of the cb2 functions below:
+void (*cb2) (int, void *);
+
+// Whether the rest of the input can be skipped (past --records, or -m reached):
+static int csv_done(CSV_status *csv_track)
 {
-    int dc = 0;  // The delimiter count
-    char *p = line;
+    return enough_errors() || csv_track->rcount >= rec_last;
+}
+
+// Callback 2 for the full parser: note where the record is, then handle it:
+static void cb2_full (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    if (csv_done(csv_track) || csv_track->rcount + 1 < rec_first) {
+        // Outside --records (or past -m), so only counted:
+        csv_track->rcount++;
+        csv_track->fcount = 0;
+        csv_track->nlcount = 0;
+        return;
+    }
+    csv_get_row_span(csv_track->p, &csv_track->row_start, &csv_track->row_end);
+    cb2(c, data);
+}
+
+// Callback 2 for CSV support, called whenever a record is processed:
+void cb2_none (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    csv_track->rcount++;
+    if ( fieldcount != csv_track->fcount ) {
+        if (with_filename) { emit_file_tag(&delim_csv, 1); }
+        emit_csv_offset(csv_track);
+        emit_csv_record(csv_track);
+    }
+
+    csv_track->fcount = 0;
+    ignore_this = c;
+}
+
+// Callback 2 for CSV support, called whenever a record is processed:
+void cb2_none_nl (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    csv_track->rcount++;
+    if ( csv_track->nlcount > 0 ) {
+        if (with_filename) { emit_file_tag(&delim_csv, 1); }
+        emit_tag("rec", csv_track->rcount, &delim_csv, 1);
+        emit_csv_offset(csv_track);
+        emit_tag("nl", csv_track->nlcount, &delim_csv, 1);
+        emit_csv_record(csv_track);
+    }
+
+    csv_track->fcount = 0;
+    csv_track->nlcount = 0;
+    ignore_this = c;
+}
+
+// Callback 2 for CSV support, called whenever a record is processed:
+void cb2_line (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    csv_track->rcount++;
+    if ( fieldcount != csv_track->fcount ) {
+        if (with_filename) { emit_file_tag(&delim_csv, 1); }
+        emit_tag("rec", csv_track->rcount, &delim_csv, 1);
+        emit_csv_offset(csv_track);
+        emit_csv_record(csv_track);
+    }
+
+    csv_track->fcount = 0;
+    ignore_this = c;
+}
+
+// Callback 2 for CSV support, called whenever a record is processed:
+void cb2_field (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    csv_track->rcount++;
+    if ( fieldcount != csv_track->fcount ) {
+        if (with_filename) { emit_file_tag(&delim_csv, 1); }
+        emit_csv_offset(csv_track);
+        emit_tag("fields", csv_track->fcount, &delim_csv, 1);
+        emit_csv_record(csv_track);
+    }
+
+    csv_track->fcount = 0;
+    ignore_this = c;
+}
+
+// Callback 2 for CSV support, called whenever a record is processed:
+void cb2_line_field (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    csv_track->rcount++;
+    if ( fieldcount != csv_track->fcount ) {
+        if (with_filename) { emit_file_tag(&delim_csv, 1); }
+        emit_tag("rec", csv_track->rcount, &delim_csv, 1);
+        emit_csv_offset(csv_track);
+        emit_tag("fields", csv_track->fcount, &delim_csv, 1);
+        emit_csv_record(csv_track);
+    }
+
+    csv_track->fcount = 0;
+    ignore_this = c;
+}
+
+// Callback 2 for --histogram, called whenever a record is processed:
+void cb2_hist (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
 
-    // A smaller strlen tells us we have NULs in the line string:
-    if ( strlen(line) < (size_t)bytes_read ) { replace_nulls(line, bytes_read); }
+    csv_track->rcount++;
+    hist_add(&fc_hist, csv_track->fcount, 1);
 
-    while((p = strstr(p, delim)))
-    {
-       dc++;
-       p += dlen;
+    csv_track->fcount = 0;
+    csv_track->nlcount = 0;
+    ignore_this = c;
+}
+
+// Callback 2 for --count, called whenever a record is processed:
+void cb2_count (int c, void *data)
+{
+    CSV_status *csv_track = (CSV_status *)data;
+
+    csv_track->rcount++;
+    if ( nl_mode ? csv_track->nlcount > 0 : fieldcount != csv_track->fcount ) {
+        mismatches++;
+    }
+
+    csv_track->fcount = 0;
+    csv_track->nlcount = 0;
+    ignore_this = c;
+}
+
+/*
+   Keep the bytes of the unfinished record at the end of a parsed chunk, so
+   it can still be output once a later chunk finishes it.
+*/
+static int csv_carry(CSV_status *csv_track, size_t bytes_read)
+{
+    size_t start, end;
+    size_t keep_from = 0;   // First byte of buf to keep
+
+    csv_get_row_span(csv_track->p, &start, &end);
+
+    if (start < csv_track->buf_off) {
+        // Still the record carried in from earlier chunks; keep all of buf too:
+        keep_from = 0;
+    }
+    else {
+        keep_from = start - csv_track->buf_off;
+        csv_track->carry_off = start;
+        csv_track->carry_len = 0;
+    }
+
+    size_t need = csv_track->carry_len + (bytes_read - keep_from);
+    if ( need > csv_track->carry_size ) {
+        size_t size = csv_track->carry_size ? csv_track->carry_size : 1024;
+        while (size < need) size *= 2;
+        char *carry = realloc(csv_track->carry, size);
+        check_mem(carry);
+        csv_track->carry = carry;
+        csv_track->carry_size = size;
+    }
+
+    memcpy(csv_track->carry + csv_track->carry_len, csv_track->buf + keep_from, bytes_read - keep_from);
+    csv_track->carry_len = need;
+    csv_track->buf_off += bytes_read;
+
+    return 0;
+
+error:
+    return -1;
+}
+
+/*
+   Handle a batch of counted records.  Those with the expected field count
+   (or without embedded newlines, with -N) are only numbered here; the rest
+   go to cb2 as the parser would send them.
+*/
+static void csv_batch_rows(struct csv_batch *b, CSV_status *csv_track)
+{
+    const struct csv_row *row = b->rows;
+    const struct csv_row *end = b->rows + b->nrows;
+
+    if (histogram) {
+        for (; row < end && csv_track->rcount < rec_last; row++) {
+            if (++csv_track->rcount >= rec_first) {
+                hist_add(&fc_hist, row->fields, 1);
+            }
+        }
+        csv_batch_clear(b);
+        return;
+    }
+
+    for (; row < end; row++) {
+        if (csv_track->rcount == csv_track->next_mark) {
+            recidx_add(&idx, csv_track->rcount, row->start, mismatches);
+            csv_track->next_mark += idx.step;
+        }
+        if ((nl_mode ? row->newlines == 0 : row->fields == fieldcount)
+                || csv_track->rcount + 1 < rec_first) {
+            csv_track->rcount++;
+            continue;
+        }
+        if (csv_track->rcount >= rec_last) break;
+        csv_track->fcount = row->fields;
+        csv_track->nlcount = row->newlines;
+        csv_track->row_start = row->start;
+        csv_track->row_end = row->end;
+        cb2(0, csv_track);
+        if (enough_errors()) break;
+    }
+    csv_batch_clear(b);
+}
+
+// Parse or count len bytes at s, whichever CSV mode asks for:
+static size_t csv_feed(struct csv_parser *p, char *s, size_t len, struct csv_batch *b, CSV_status *csv_track)
+{
+    size_t done = 0;
+
+    if (csv_full) {
+        // With -m, parsed in steps so it can stop soon after the last one:
+        size_t step = max_errors ? CSV_FULL_STEP : len;
+        while (done < len && !csv_done(csv_track)) {
+            size_t n = (len - done < step) ? len - done : step;
+            size_t parsed = csv_parse(p, s + done, n, cb1, cb2_full, csv_track);
+            done += parsed;
+            if (parsed != n) break;
+        }
+        return done;
     }
 
-    return dc;
+    // Count until the batch fills up, handle it, and carry on:
+    while (done < len && !csv_done(csv_track)) {
+        done += csv_count_batch(p, s + done, len - done, b);
+        if (b->nrows == 0) break;
+        csv_batch_rows(b, csv_track);
+    }
+    return done;
 }
 
-
 /*
-   Process a regular delimited file.
-   Output records NOT matching fieldcount.
+   Process a CSV file.  Regular files are mapped and handed to the parser
+   in one piece (unless read with --io-uring); anything else is read in
+   buffers of buffer_size bytes.
 */
-static int ncount(char *filename)
+int ncount_csv(char *filename)
 {
-    char *line = NULL;
+    struct csv_parser p;
+    mmfile map;
+    int mapped = 0;
+    char *buf = NULL;
     FILE *fp = NULL;
-    size_t len = 0;         // allocated size for line
-    ssize_t bytes_read = 0; // num of chars read
-    const unsigned int dlen = strlen(delim);
-
-    if (filename[0] == '-') {
-        fp = stdin;
+    readahead ra;
+    size_t bytes_read = 0; // num of chars read
+    size_t parsed = 0;     // num of chars parsed
+    struct csv_batch batch = { NULL, CSV_BATCH_ROWS, 0, NULL, 0, 0 };
+    CSV_status *csv_track = (CSV_status *)calloc(1, sizeof(CSV_status));
+
+    check_mem(csv_track);
+    csv_track->p = &p;
+    csv_track->next_mark = index_out ? 0 : UINT64_MAX;
+    batch.rows = malloc(CSV_BATCH_ROWS * sizeof(struct csv_row));
+    check_mem(batch.rows);
+
+    check(csv_setup(&p) == 0, "Error initializing CSV parser.");
+
+    if (filename[0] != '-' && !use_uring) {
+        int rc = mmfile_open(&map, filename);
+        check_debug(rc != -1, "Error opening file: %s.", filename);
+        mapped = (rc == 0);
     }
-    else {
-        fp = fopen(filename, "rb");
+
+    // Only an empty file isn't mapped, and any range of it is empty:
+    check(mapped || !byte_range || empty_file(filename), "ERROR: --byte-range needs a regular file: %s", filename);
+
+    if (byte_range && !mapped) {
+        // Nothing to count
     }
+    else if (mapped) {
+        size_t start = 0;       // Where counting starts
+        size_t stop = map.size; // and ends
 
-    check(fp != NULL, "Error opening file: %s.", filename);
+        // Every record stays in the mapping, so nothing is carried:
+        csv_track->buf = map.data;
+        csv_track->mapped = 1;
 
-    while ((bytes_read = getline(&line, &len, fp)) != -1) {
+        if (byte_range) {
+            check(csv_window(&map, &start, &stop) == 0, "Error in file: %s", filename);
+            csv_count_start(&p, start, 0);
+        }
 
-        if ( fieldcount != (dcount(line, delim, dlen, bytes_read) + 1) ) {
-            printf("%s", line);
+        if (index_in != NULL) {
+            // Start from the last checkpoint before the first record wanted:
+            const recidx_mark *m = recidx_find(&idx, rec_first);
+            if (m != NULL) {
+                start = m->offset;
+                csv_track->rcount = m->rnum;
+                csv_count_start(&p, start, 0);
+            }
         }
-    }
 
-    free(line);
-    fclose(fp);
+        parsed = csv_feed(&p, map.data + start, stop - start, &batch, csv_track);
+        check(parsed == stop - start || csv_done(csv_track), "Error while parsing file: %s", csv_strerror(csv_error(&p)));
+    }
+    else {
+        if (filename[0] == '-') {
+            fp = stdin;
+        }
+        else {
+            fp = fopen(filename, "rb");
+        }
 
-    return 0;
+        check(fp != NULL, "Error opening file: %s.", filename);
+        check_debug(readahead_start(&ra, fp, buffer_size, 0, use_uring ? READAHEAD_URING : 0) == 0,
+                    "Error reading file: %s.", filename);
 
-error:
-    return -1;
-}
+        while ((bytes_read = readahead_next(&ra, NULL, 0, &buf)) > 0) {
+            csv_track->buf = buf;
+            parsed = csv_feed(&p, buf, bytes_read, &batch, csv_track);
+            if (csv_done(csv_track)) break;
+            check(parsed == bytes_read, "Error while parsing file: %s", csv_strerror(csv_error(&p)));
+            check(csv_carry(csv_track, bytes_read) == 0, "Error keeping unfinished CSV record.");
+        }
+        check(bytes_read > 0 || ra.error == 0, "Error reading file: %s: %s.", filename, strerror(ra.error));
 
-/* Version with line number added */
-static int ncount_line(char *filename)
-{
-    char *line = NULL;
-    FILE *fp = NULL;
-    size_t len = 0;         // allocated size for line
-    ssize_t bytes_read = 0; // num of chars read
-    const unsigned int dlen = strlen(delim);
-    unsigned int lnum = 0;
+        // Whatever is left of the input is in carry now:
+        csv_track->buf = csv_track->carry + csv_track->carry_len;
+    }
 
-    if (filename[0] == '-') {
-        fp = stdin;
+    if (csv_done(csv_track)) {
+        // Stopped early; the rest of the input doesn't matter.
+    }
+    else if (csv_full) {
+        check(csv_fini(&p, cb1, cb2_full, csv_track) == 0, "Error finishing CSV processing.");
     }
     else {
-        fp = fopen(filename, "rb");
+        check(csv_count_batch_fini(&p, &batch) == 0, "Error finishing CSV processing.");
+        csv_batch_rows(&batch, csv_track);
     }
 
-    check(fp != NULL, "Error opening file: %s.", filename);
+    if (index_out != NULL) {
+        idx.records = csv_track->rcount;
+        idx.mismatches = mismatches;
+    }
 
-    while ((bytes_read = getline(&line, &len, fp)) != -1) {
+    csv_free(&p);
+    free(batch.rows);
+    free(csv_track->carry);
+    free(csv_track);
 
-        lnum++;
-        if ( fieldcount != (dcount(line, delim, dlen, bytes_read) + 1) ) {
-            printf("[rec:%d]%s%s", lnum, delim, line);
-        }
+    if (mapped) {
+        // Records may still be referenced from the mapping:
+        outbuf_flush(out);
+        mmfile_close(&map);
+    }
+    else if (fp != NULL) {
+        readahead_stop(&ra);
+        fclose(fp);
     }
-
-    free(line);
-    fclose(fp);
 
     return 0;
 
@@ -190,35 +1771,113 @@ error:
     return -1;
 }
 
-/* Version with field count added */
-static int ncount_field(char *filename)
-{
-    char *line = NULL;
-    FILE *fp = NULL;
-    size_t len = 0;         // allocated size for line
-    ssize_t bytes_read = 0; // num of chars read
-    const unsigned int dlen = strlen(delim);
-    unsigned int fc = 0;
 
-    if (filename[0] == '-') {
-        fp = stdin;
+// Hand a record counted by a worker thread to cb2, as its parser would have:
+static void emit_csv_hit(CSV_status *csv_track, size_t start, size_t end, uint64_t rnum, uint64_t fields)
+{
+    csv_track->rcount = rnum - 1;
+    csv_track->fcount = fields;
+    csv_track->row_start = start;
+    if (nl_mode) {
+        // Records can span chunks, so their newlines are counted here:
+        csv_track->nlcount = newline_count(csv_track->buf + start, end - start);
     }
-    else {
-        fp = fopen(filename, "rb");
+    csv_track->row_end = end;
+    cb2(0, csv_track);
+}
+
+/*
+   Version of ncount_csv() that counts a mapped file in chunks on worker
+   threads.  Each chunk is counted under both states it can start in;
+   going through the chunks in order tells which guess was right, and an
+   unfinished record is carried into the next chunk.
+*/
+static int ncount_csv_threads(char *filename)
+{
+    mmfile map;
+    Pool pool = {0};
+    CSV_status csv_track = {0};
+    uint64_t rnum = 0;      // Records in the chunks already written
+    int pending = CSV_PENDING_NONE;
+    uint64_t fields = 0;    // Fields ended in the unfinished record
+    size_t row_start = 0;   // Where the unfinished record began
+    size_t from, to;        // The bytes wanted (see csv_window())
+    int failed = 0;
+
+    int rc = mmfile_open(&map, filename);
+    check_debug(rc != -1, "Error mapping file: %s.", filename);
+    if (rc == 1) {
+        return ncount_csv(filename);
     }
 
-    check(fp != NULL, "Error opening file: %s.", filename);
+    // Offsets are from the start of the mapping, where all records are:
+    csv_track.buf = map.data;
+    csv_track.mapped = 1;
+
+    pool.csv = 1;
+    rc = csv_window(&map, &from, &to);
+    if (rc == 0) {
+        rc = pool_start(&pool, &map, from, to);
+    }
 
-    while ((bytes_read = getline(&line, &len, fp)) != -1) {
+    Chunk *ch = NULL;
+    for (size_t i = 0; rc == 0 && !failed && (ch = pool_wait(&pool, i)) != NULL; i++) {
+        int quoted = (pending == CSV_PENDING_QUOTED && !ch->exact);
+        CsvGuess *g = &ch->guess[quoted];
+        CsvGuess *last = (quoted && ch->converged) ? &ch->guess[0] : g;
+
+        failed |= ch->failed;
+        for (size_t k = 0; k < g->nhits && !failed && !enough_errors(); k++) {
+            Mismatch *m = &g->hits[k];
+            if (quoted && m->rnum == 1) {
+                // The end of the record carried in:
+                emit_csv_hit(&csv_track, row_start, m->line + m->len - map.data, rnum + 1, fields + m->fc);
+            }
+            else {
+                emit_csv_hit(&csv_track, m->line - map.data, m->line + m->len - map.data, rnum + m->rnum, m->fc);
+            }
+        }
+        uint64_t records = g->records;
+
+        // Once the guesses agreed, the rest of the chunk is in guess[0]:
+        if (last != g) {
+            for (size_t k = ch->conv_nhits; k < last->nhits && !failed && !enough_errors(); k++) {
+                Mismatch *m = &last->hits[k];
+                emit_csv_hit(&csv_track, m->line - map.data, m->line + m->len - map.data,
+                             rnum + records + m->rnum - ch->conv_records, m->fc);
+            }
+            records += last->records - ch->conv_records;
+            add_mismatches(last->bad - ch->conv_bad);
+        }
+        add_mismatches(g->bad);
+        hist_merge(&fc_hist, &g->counts);
+        hist_merge(&fc_hist, &ch->counts);
 
-        fc = dcount(line, delim, dlen, bytes_read) + 1;
-        if ( fieldcount != fc ) {
-            printf("[fields:%d]%s%s", fc, delim, line);
+        if (quoted && records == 0) {
+            // Still inside the record carried in:
+            fields += last->fields;
+        }
+        else {
+            fields = last->fields;
+            row_start = last->row_start;
         }
+        pending = last->pending;
+        rnum += records;
+        pool_release(&pool, i);
+        if (enough_errors()) break;
     }
 
-    free(line);
-    fclose(fp);
+    // Like csv_count_fini(), for a file not ending in a newline:
+    if (rc == 0 && !failed && !enough_errors() && pending != CSV_PENDING_NONE) {
+        emit_csv_hit(&csv_track, row_start, map.size, rnum + 1, fields + 1);
+    }
+
+    pool_stop(&pool);
+    outbuf_flush(out);
+    mmfile_close(&map);
+
+    check(rc == 0, "Error counting file: %s.", filename);
+    check(!failed, "Out of memory.");
 
     return 0;
 
@@ -226,37 +1885,67 @@ error:
     return -1;
 }
 
-/* Version with line num and field count added */
-static int ncount_line_field(char *filename)
+/*
+   What the records of a file depend on (lines, or a CSV dialect), and what
+   its mismatches depend on as well, so an index is only used with the
+   options it was written with.
+*/
+static uint64_t index_layout(int csv_mode)
+{
+    if (!csv_mode) return 0;
+    return 1 | (uint64_t)(unsigned char)delim_csv << 8 | (uint64_t)(unsigned char)quote << 16;
+}
+
+static uint64_t index_check(uint64_t layout)
 {
-    char *line = NULL;
-    FILE *fp = NULL;
-    size_t len = 0;         // allocated size for line
-    ssize_t bytes_read = 0; // num of chars read
-    const unsigned int dlen = strlen(delim);
-    unsigned int lnum = 0;
-    unsigned int fc = 0;
+    uint64_t v[3] = { layout, fieldcount, (uint64_t)nl_mode };
+    const unsigned char *c = (const unsigned char *)v;
+    uint64_t h = 0xcbf29ce484222325ull;     // FNV-1a
 
-    if (filename[0] == '-') {
-        fp = stdin;
+    for (size_t i = 0; i < sizeof(v); i++) {
+        h = (h ^ c[i]) * 0x100000001b3ull;
     }
-    else {
-        fp = fopen(filename, "rb");
+    for (c = (const unsigned char *)delim; *c; c++) {
+        h = (h ^ *c) * 0x100000001b3ull;
     }
+    return h;
+}
 
-    check(fp != NULL, "Error opening file: %s.", filename);
+// Write one line of the --histogram table: a field count and its records:
+static int emit_hist_row(uint64_t fields, uint64_t records, void *data)
+{
+    outbuf_putu(out, fields);
+    outbuf_putc(out, '\t');
+    outbuf_putu(out, records);
+    outbuf_putc(out, '\n');
+    (void)data;
+    return 0;
+}
 
-    while ((bytes_read = getline(&line, &len, fp)) != -1) {
+/*
+   Process one FILE, splitting it between threads if chunked is set.  In
+   CSV mode, cb2 must be set.
+*/
+static int process_file(char *filename, int csv_mode, int chunked)
+{
+    cur_file = filename;
+    cur_file_len = strlen(filename);
+    mismatches = 0;
 
-        lnum++;
-        fc = dcount(line, delim, dlen, bytes_read) + 1;
-        if ( fieldcount != fc ) {
-            printf("[rec:%d]%s[fields:%d]%s%s", lnum, delim, fc, delim, line);
+    if (csv_mode) {
+        if (chunked && !csv_full && filename[0] != '-') {
+            check(ncount_csv_threads(filename) == 0, "Error in CSV-mode processing of file: %s", filename);
+        }
+        else {
+            check(ncount_csv(filename) == 0, "Error in CSV-mode processing of file: %s", filename);
         }
     }
-
-    free(line);
-    fclose(fp);
+    else if (chunked && filename[0] != '-') {
+        check(ncount_threads(filename) == 0, "Error processing file: %s", filename);
+    }
+    else {
+        check(ncount(filename) == 0, "Error processing file: %s", filename);
+    }
 
     return 0;
 
@@ -264,175 +1953,283 @@ error:
     return -1;
 }
 
-// Callback 1 for CSV support, called whenever a field is processed:
-void cb1 (void *s, size_t len, void *data)
+// Mismatches among the first r records of the FILE indexed, if the index
+// knows (r is a checkpoint, or all the records), else UINT64_MAX:
+static uint64_t index_mismatches(uint64_t r)
 {
-    size_t fld_size;
-    char *fld = (char *)s;
-    CSV_status *csv_track = (CSV_status *)data;
-
-    if ( strlen(fld) < len ) { replace_nulls(fld, (ssize_t)len); }
-
-    csv_track->fcount++;
-    fld_size = csv_write2(NULL, 0, len ? fld : "", len, quote);
-    char *out_temp = (char *)malloc((fld_size + 1) * sizeof(char));
-    csv_write2(out_temp, fld_size, len ? fld : "", len, quote);
-    out_temp[fld_size] = '\0';  // NUL-terminate the written field
-    if ( csv_track->record == NULL ) {
-        Sasprintf(csv_track->record, "%s", out_temp);
-    }
-    else {
-        Sasprintf(csv_track->record, "%s%c%s", csv_track->record, delim_csv, out_temp);
-    }
-    free(out_temp);
+    if (r == idx.records) return idx.mismatches;
+    if (r % idx.step != 0 || r / idx.step >= idx.nmarks) return UINT64_MAX;
+    return idx.marks[r / idx.step].mismatches;
 }
 
-// A function pointer to one of the cb2 functions below:
-void (*cb2) (int, void *);
-
-// Callback 2 for CSV support, called whenever a record is processed:
-void cb2_none (int c, void *data)
+// Scan records first to last for --count, adding their mismatches to *found:
+static int count_records(char *filename, int csv_mode, uint64_t first, uint64_t last, uint64_t *found)
 {
-    CSV_status *csv_track = (CSV_status *)data;
+    if (first > last) return 0;
 
-    csv_track->rcount++;
-    if ( fieldcount != csv_track->fcount ) {
-        printf("%s\n", csv_track->record);
-    }
+    rec_first = first;
+    rec_last = last;
+    check_debug(process_file(filename, csv_mode, 0) == 0, "Error processing file: %s", filename);
+    *found += mismatches;
+    return 0;
 
-    csv_track->fcount = 0;
-    free(csv_track->record);
-    csv_track->record = NULL;
-    ignore_this = c;
+error:
+    return -1;
 }
 
-// Callback 2 for CSV support, called whenever a record is processed:
-void cb2_none_nl (int c, void *data)
+/*
+   --count of --records from an unchanged index written with the same
+   options.  The mismatches between two checkpoints are the difference of
+   theirs, so only the records before the first checkpoint in the range and
+   after the last are scanned.
+*/
+static int count_from_index(char *filename, int csv_mode)
 {
-    CSV_status *csv_track = (CSV_status *)data;
-
-    csv_track->rcount++;
-    unsigned int nlcount = newline_count(csv_track->record);
-    if ( nlcount > 0 ) {
-        printf("[rec:%d]%c[nl:%d]%c%s\n", csv_track->rcount, delim_csv, nlcount, delim_csv, csv_track->record);
+    uint64_t first = rec_first;
+    uint64_t wanted = rec_last;
+    uint64_t last = (rec_last < idx.records) ? rec_last : idx.records;
+    uint64_t found = 0;
+    int rc = 0;
+
+    // The first checkpoint at or after record first - 1, and the last at
+    // or before record last (the end of the file counts as one):
+    uint64_t a = (first - 1 + idx.step - 1) / idx.step * idx.step;
+    uint64_t b = (last == idx.records) ? last : last / idx.step * idx.step;
+    if (a > idx.records || index_mismatches(a) == UINT64_MAX) a = idx.records;
+    if (index_mismatches(b) == UINT64_MAX) b = (idx.nmarks > 0) ? (idx.nmarks - 1) * idx.step : 0;
+
+    if (first > last) {
+        // Past the end of the file
+    }
+    else if (a > b || index_mismatches(b) == UINT64_MAX) {
+        rc = count_records(filename, csv_mode, first, last, &found);
+    }
+    else {
+        found = index_mismatches(b) - index_mismatches(a);
+        rc = count_records(filename, csv_mode, first, a, &found);
+        if (rc == 0) rc = count_records(filename, csv_mode, b + 1, last, &found);
     }
 
-    csv_track->fcount = 0;
-    free(csv_track->record);
-    csv_track->record = NULL;
-    ignore_this = c;
+    rec_first = first;
+    rec_last = wanted;
+    mismatches = found;
+    return rc;
 }
 
-// Callback 2 for CSV support, called whenever a record is processed:
-void cb2_line (int c, void *data)
+// Write the --count line of a FILE, like grep -c, naming it if asked to:
+static void emit_count(const char *filename, uint64_t count, int named)
 {
-    CSV_status *csv_track = (CSV_status *)data;
-
-    csv_track->rcount++;
-    if ( fieldcount != csv_track->fcount ) {
-        printf("[rec:%d]%c%s\n", csv_track->rcount, delim_csv, csv_track->record);
+    if (named) {
+        outbuf_write(out, filename, strlen(filename));
+        outbuf_putc(out, ':');
     }
-
-    csv_track->fcount = 0;
-    free(csv_track->record);
-    csv_track->record = NULL;
-    ignore_this = c;
+    outbuf_putu(out, count);
+    outbuf_putc(out, '\n');
 }
 
-// Callback 2 for CSV support, called whenever a record is processed:
-void cb2_field (int c, void *data)
+// Fold what was found in a FILE into the exit status for --count and -m:
+static void update_status(int *status, uint64_t found, int stopped)
 {
-    CSV_status *csv_track = (CSV_status *)data;
-
-    csv_track->rcount++;
-    if ( fieldcount != csv_track->fcount ) {
-        printf("[fields:%d]%c%s\n", csv_track->fcount, delim_csv, csv_track->record);
+    if (stopped) {
+        *status = EXIT_MAX_ERRORS;
+    }
+    else if (found > 0 && *status == EXIT_NO_MISMATCH) {
+        *status = EXIT_MISMATCH;
     }
-
-    csv_track->fcount = 0;
-    free(csv_track->record);
-    csv_track->record = NULL;
-    ignore_this = c;
 }
 
-// Callback 2 for CSV support, called whenever a record is processed:
-void cb2_line_field (int c, void *data)
+// A FILE handed to a worker thread, when several are given with -t:
+typedef struct {
+    char *name;
+    uint64_t size;          // For handing out the largest first
+    spill output;           // Its output, kept until written in turn
+    uint64_t mismatches;    // Mismatching records found
+    int stopped;            // -m was reached
+    int failed;
+    int done;               // Set (under FilePool.lock) once processed
+} FileJob;
+
+// FILEs processed by worker threads, each whole by one thread:
+typedef struct {
+    FileJob *jobs;          // In command-line order
+    size_t njobs;
+    FileJob **order;        // In the order to hand them out
+    size_t next;            // Next in order to hand out
+    FileJob **finished;     // In the order they were processed
+    size_t nfinished;
+    int csv_mode;
+    hist *counts;           // Where the workers' --histogram counts go
+    pthread_t *workers;
+    unsigned int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} FilePool;
+
+// Largest first:
+static int file_job_cmp(const void *a, const void *b)
 {
-    CSV_status *csv_track = (CSV_status *)data;
-
-    csv_track->rcount++;
-    if ( fieldcount != csv_track->fcount ) {
-        printf("[rec:%d]%c[fields:%d]%c%s\n", csv_track->rcount, delim_csv, csv_track->fcount, delim_csv, csv_track->record);
-    }
+    uint64_t x = (*(FileJob * const *)a)->size;
+    uint64_t y = (*(FileJob * const *)b)->size;
+    return (x < y) - (x > y);
+}
 
-    csv_track->fcount = 0;
-    free(csv_track->record);
-    csv_track->record = NULL;
-    ignore_this = c;
+static int spill_sink(void *data, const void *s, size_t n)
+{
+    return spill_add((spill *)data, s, n);
 }
 
-int ncount_csv(char *filename)
+static void *file_worker(void *arg)
 {
-    struct csv_parser p;
-    char buf[1024];
-    FILE *fp = NULL;
-    size_t bytes_read = 0; // num of chars read
-    CSV_status *csv_track = (CSV_status *)malloc(sizeof(CSV_status));
+    FilePool *pool = (FilePool *)arg;
+    outbuf buf;
+    int ready = (outbuf_init(&buf, -1, OUTBUF_SIZE) == 0);
 
-    csv_track->rcount = 0;
-    csv_track->fcount = 0;
-    csv_track->record = NULL;
+    // Everything output goes to the spill of the FILE being processed:
+    out = &buf;
 
-    if (filename[0] == '-') {
-        fp = stdin;
-    }
-    else {
-        fp = fopen(filename, "rb");
-    }
+    while (1) {
+        size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->njobs) break;
+        FileJob *job = pool->order[i];
+
+        if (ready) {
+            outbuf_set_sink(&buf, spill_sink, &job->output);
+            job->failed = (process_file(job->name, pool->csv_mode, 0) != 0);
+            if (count_only) {
+                emit_count(job->name, mismatches, 1);
+            }
+            job->failed |= (outbuf_flush(&buf) != 0);
+            buf.error = 0;
+            job->mismatches = mismatches;
+            job->stopped = enough_errors();
+        }
+        else {
+            job->failed = 1;
+        }
 
-    check(fp != NULL, "Error opening file: %s.", filename);
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pool->finished[pool->nfinished++] = job;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
 
-    check(csv_init(&p, CSV_APPEND_NULL) == 0, "Error initializing CSV parser.");
+    pthread_mutex_lock(&pool->lock);
+    hist_merge(pool->counts, &fc_hist);
+    pthread_mutex_unlock(&pool->lock);
+    hist_free(&fc_hist);
 
-    // Set some parsing params:
-    csv_set_delim(&p, delim_csv);
-    csv_set_quote(&p, quote);
+    if (ready) outbuf_free(&buf);
+    bufpool_drain();
+    return NULL;
+}
 
-    while ((bytes_read=fread(buf, 1, 1024, fp)) > 0) {
-        check(csv_parse(&p, buf, bytes_read, cb1, cb2, csv_track) == bytes_read, "Error while parsing file: %s", csv_strerror(csv_error(&p)));
+/*
+   Version of the loop over the FILEs that processes up to -t of them at a
+   time, the largest first.  Each FILE's output is kept until it can be
+   written whole: in command-line order, or with -H, as soon as it's done.
+*/
+static int ncount_files(char **names, size_t n, int csv_mode, int *status)
+{
+    FilePool pool = {0};
+    int rc = 0;
+
+    pool.jobs = calloc(n, sizeof(FileJob));
+    pool.order = calloc(n, sizeof(FileJob *));
+    pool.finished = calloc(n, sizeof(FileJob *));
+    check_mem(pool.jobs && pool.order && pool.finished);
+    pool.njobs = n;
+    pool.csv_mode = csv_mode;
+    pool.counts = &fc_hist;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    for (size_t i = 0; i < n; i++) {
+        struct stat st;
+        FileJob *job = &pool.jobs[i];
+        job->name = names[i];
+        job->size = (stat(names[i], &st) == 0) ? (uint64_t)st.st_size : 0;
+        spill_init(&job->output, FILE_SPILL_AFTER);
+        pool.order[i] = job;
+    }
+    qsort(pool.order, n, sizeof(FileJob *), file_job_cmp);
+
+    pool.workers = calloc(threads, sizeof(pthread_t));
+    check_mem(pool.workers);
+    for (; pool.nworkers < threads && pool.nworkers < n; pool.nworkers++) {
+        if (pthread_create(&pool.workers[pool.nworkers], NULL, file_worker, &pool) != 0) {
+            log_err("Error starting thread.");
+            rc = -1;
+            break;
+        }
     }
 
-    check(csv_fini(&p, cb1, cb2, csv_track) == 0, "Error finishing CSV processing.");
+    for (size_t k = 0; k < n && rc == 0 && pool.nworkers > 0; k++) {
+        FileJob *job = with_filename ? NULL : &pool.jobs[k];
 
-    csv_free(&p);
-    free(csv_track);
+        pthread_mutex_lock(&pool.lock);
+        if (job == NULL) {
+            while (pool.nfinished <= k) pthread_cond_wait(&pool.done, &pool.lock);
+            job = pool.finished[k];
+        }
+        while (!job->done) pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (job->failed) {
+            rc = -1;
+            break;
+        }
+        if (spill_write(&job->output, out) != 0) {
+            log_err("Error writing output of file: %s", job->name);
+            rc = -1;
+            break;
+        }
+        spill_free(&job->output);
+        update_status(status, job->mismatches, job->stopped);
+    }
 
-    fclose(fp);
+    // Whatever is left unprocessed after an error is skipped:
+    __atomic_store_n(&pool.next, n, __ATOMIC_RELAXED);
+    for (unsigned int t = 0; t < pool.nworkers; t++) {
+        pthread_join(pool.workers[t], NULL);
+    }
+    for (size_t i = 0; i < n; i++) {
+        spill_free(&pool.jobs[i].output);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.done);
+    free(pool.workers);
+    free(pool.jobs);
+    free(pool.order);
+    free(pool.finished);
 
-    return 0;
+    return rc;
 
 error:
+    free(pool.jobs);
+    free(pool.order);
+    free(pool.finished);
     return -1;
 }
 
-
 /* The main function */
 int main (int argc, char *argv[])
 {
     int c;
     int delim_arg_flag = 0;
     int fieldcount_arg_flag = 0;
-    int add_lnum_arg_flag = 0;
-    int add_fc_arg_flag = 0;
     int csv_mode = 0;
-    int nl_mode = 0;
+    int status = EXIT_NO_MISMATCH;  // Exit status with --count or -m
+    unsigned long long n = 0;       // A number given with -t or -m
+
+    scan_init();
 
     while (1) {
 
         // getopt_long stores the option index here.
         int option_index = 0;
 
-        c = getopt_long (argc, argv, "hlCcNd:n:", long_options, &option_index);
+        c = getopt_long (argc, argv, "hlCcHNd:n:m:Q:t:", long_options, &option_index);
 
         // Detect the end of the options.
         if (c == -1) break;
@@ -456,12 +2253,17 @@ int main (int argc, char *argv[])
 
             case 'l':
                 debug("option -l");
-                add_lnum_arg_flag = 1;
+                add_lnum = 1;
                 break;
 
             case 'c':
                 debug("option -c");
-                add_fc_arg_flag = 1;
+                add_fc = 1;
+                break;
+
+            case 'H':
+                debug("option -H");
+                with_filename = 1;
                 break;
 
             case 'C':
@@ -481,6 +2283,79 @@ int main (int argc, char *argv[])
                 nl_mode = 1;
                 break;
 
+            case 't':
+                debug("option -t with value `%s'", optarg);
+                check(parse_count(optarg, &n) == 0 && n <= INT_MAX,
+                      "ERROR: Please specify a positive number of threads with -t");
+                threads = (unsigned int) n;
+                break;
+
+            case 'm':
+                debug("option -m with value `%s'", optarg);
+                check(parse_count(optarg, &n) == 0, "ERROR: Please specify a positive number of records with -m");
+                max_errors = n;
+                break;
+
+            case COUNT_OPTION:
+                debug("option --count");
+                count_only = 1;
+                break;
+
+            case RECORDS_OPTION:
+                debug("option --records with value `%s'", optarg);
+                check(parse_records(optarg, &rec_first, &rec_last) == 0,
+                      "ERROR: Invalid record range: %s", optarg);
+                break;
+
+            case BYTE_RANGE_OPTION:
+                debug("option --byte-range with value `%s'", optarg);
+                check(parse_byte_range(optarg, &range_start, &range_end) == 0,
+                      "ERROR: Invalid byte range: %s", optarg);
+                byte_range = 1;
+                break;
+
+            case IO_URING_OPTION:
+                debug("option --io-uring");
+                use_uring = 1;
+                break;
+
+            case INDEX_OPTION:
+                debug("option --index with value `%s'", optarg);
+                index_in = optarg;
+                break;
+
+            case WRITE_INDEX_OPTION:
+                debug("option --write-index with value `%s'", optarg);
+                index_out = optarg;
+                break;
+
+            case HISTOGRAM_OPTION:
+                debug("option --histogram");
+                histogram = 1;
+                break;
+
+            case ADD_OFFSET_OPTION:
+                debug("option --add-offset");
+                add_offset = 1;
+                break;
+
+            case CSV_FULL_OPTION:
+                debug("option --csv-full");
+                csv_full = 1;
+                break;
+
+            case BUFFER_SIZE_OPTION:
+                debug("option --buffer-size with value `%s'", optarg);
+                check(parse_size(optarg, &buffer_size) == 0 && buffer_size > 0,
+                      "ERROR: Invalid buffer size: %s", optarg);
+                break;
+
+            case SPILL_AFTER_OPTION:
+                debug("option --spill-after with value `%s'", optarg);
+                check(parse_size(optarg, &record_buffer_size) == 0,
+                      "ERROR: Invalid size: %s", optarg);
+                break;
+
             case 'h':
                 debug("option -h");
                 usage(0);
@@ -506,77 +2381,144 @@ int main (int argc, char *argv[])
         delim_csv = delim_arg[0];
     }
     else if (!csv_mode && delim_arg_flag) {
+        check(strlen(delim_arg) > 0, "ERROR: The delimiter must not be empty");
         delim = delim_arg;
     }
+    dlen = strlen(delim);
 
     if (fieldcount_arg_flag) {
-        fieldcount = (unsigned int) strtol(fieldcount_arg, (char **)NULL, 10);
+        fieldcount = strtoull(fieldcount_arg, (char **)NULL, 10);
+    }
+
+    check((fieldcount > 0 || (csv_mode && nl_mode) || histogram), "ERROR: Please specify a valid field count with -n");
+    check(!(histogram && (count_only || max_errors)), "ERROR: --histogram can't be used with --count or -m");
+
+    int ranged = (rec_first > 1 || rec_last < UINT64_MAX);
+    check(!(index_out && (index_in || ranged || max_errors || histogram || csv_full)),
+          "ERROR: --write-index can't be used with --index, --records, -m, --histogram or --csv-full");
+
+    // Offsets are the same as in a whole-file run, so the output of
+    // consecutive ranges adds up to it:
+    check(!(byte_range && (ranged || index_in || index_out)),
+          "ERROR: --byte-range can't be used with --records, --index or --write-index");
+    if (byte_range) add_offset = 1;
+
+    // Going straight to a range or a checkpoint needs the mapping, and
+    // without io_uring FILEs are mapped anyway:
+    if (use_uring && (byte_range || index_in || !uring_available())) use_uring = 0;
+
+    if (index_in || index_out) {
+        uint64_t layout = index_layout(csv_mode);
+
+        check(argc - optind == 1, "ERROR: --index and --write-index need exactly one FILE");
+        if (index_in) {
+            check(recidx_load(&idx, index_in) == 0, "Error reading index: %s", index_in);
+            check(idx.layout == layout && recidx_fresh(&idx, argv[optind]),
+                  "ERROR: %s is out of date, or not an index of %s with these options", index_in, argv[optind]);
+        }
+        else {
+            recidx_init(&idx, INDEX_STEP);
+            check(recidx_stamp(&idx, argv[optind]) == 0, "ERROR: Only a regular file can be indexed: %s", argv[optind]);
+            idx.layout = layout;
+            idx.check = index_check(layout);
+        }
     }
 
-    check((fieldcount > 0 || (csv_mode && nl_mode)), "ERROR: Please specify a valid field count with -n");
+    check(outbuf_init(out, STDOUT_FILENO, OUTBUF_SIZE) == 0, "Error allocating output buffer.");
+
+    // Reading and writing streamed input on threads of their own only pays
+    // with more than one CPU, and with blocks big enough to hand over:
+    pipelined = (sysconf(_SC_NPROCESSORS_ONLN) > 1 && buffer_size >= PIPELINE_MIN_BLOCK);
 
     int j = optind;  // A copy of optind (the number of options at the command-line),
                      // which is not the same as argc, as that counts ALL
                      // arguments.  (optind <= argc).
 
-    // Process any remaining command line arguments (input files).
-    do {
-
-        char *filename = NULL;
-
-        // Assume STDIN if no additional arguments, else loop through them:
-        if (optind == argc) {
-            filename = "-";
+    if (csv_mode) {
+        if (histogram) {
+            cb2 = cb2_hist;
         }
-        else if (optind < argc) {
-            filename = argv[j];
+        else if (count_only) {
+            cb2 = cb2_count;
         }
-        else if (optind > argc) {
-            break;
+        else if (nl_mode) {
+            cb2 = cb2_none_nl;
+        }
+        else if (add_lnum && add_fc) {
+            cb2 = cb2_line_field;
+        }
+        else if (add_fc) {
+            cb2 = cb2_field;
+        }
+        else if (add_lnum) {
+            cb2 = cb2_line;
+        }
+        else {
+            cb2 = cb2_none;
         }
+    }
+
+    // Several FILEs with -t are processed side by side:
+    if (threads > 1 && argc - optind > 1) {
+        check_debug(ncount_files(argv + optind, argc - optind, csv_mode, &status) == 0, "Error processing files.");
+    }
+    else {
+        // Process any remaining command line arguments (input files).
+        do {
 
-        debug("The filename is %s", filename);
+            char *filename = NULL;
 
-        // Process the file:
-        if (csv_mode) {
-            if (nl_mode) {
-                cb2 = cb2_none_nl;
+            // Assume STDIN if no additional arguments, else loop through them:
+            if (optind == argc) {
+                filename = "-";
             }
-            else if (add_lnum_arg_flag && add_fc_arg_flag) {
-                cb2 = cb2_line_field;
+            else if (optind < argc) {
+                filename = argv[j];
             }
-            else if (add_fc_arg_flag) {
-                cb2 = cb2_field;
+            else if (optind > argc) {
+                break;
             }
-            else if (add_lnum_arg_flag) {
-                cb2 = cb2_line;
+
+            debug("The filename is %s", filename);
+
+            // Process the file:
+            if (count_only && index_in && !max_errors
+                    && idx.check == index_check(index_layout(csv_mode))) {
+                // Unchanged since it was indexed with the same options:
+                check_debug(count_from_index(filename, csv_mode) == 0, "Error processing file: %s", filename);
             }
             else {
-                cb2 = cb2_none;
+                check_debug(process_file(filename, csv_mode, threads > 1 && !index_out && !ranged) == 0,
+                            "Error processing file: %s", filename);
             }
-            check(ncount_csv(filename) == 0, "Error in CSV-mode processing of file: %s", filename);
-        }
-        else {
-            if (add_lnum_arg_flag && add_fc_arg_flag) {
-                check(ncount_line_field(filename) == 0, "Error processing file: %s", filename);
-            }
-            else if (add_fc_arg_flag) {
-                check(ncount_field(filename) == 0, "Error processing file: %s", filename);
-            }
-            else if (add_lnum_arg_flag) {
-                check(ncount_line(filename) == 0, "Error processing file: %s", filename);
-            }
-            else {
-                check(ncount(filename) == 0, "Error processing file: %s", filename);
+
+            if (count_only) {
+                emit_count(filename, mismatches, argc - optind > 1 || with_filename);
             }
-        }
+            update_status(&status, mismatches, enough_errors());
 
-        j++;
+            j++;
 
-    } while (j < argc);
+        } while (j < argc);
+    }
 
-    return 0;
+    if (index_out) {
+        check(!idx.error && recidx_save(&idx, index_out) == 0, "Error writing index: %s", index_out);
+    }
+    recidx_free(&idx);
+
+    if (histogram) {
+        check(!fc_hist.error && hist_each(&fc_hist, emit_hist_row, NULL) == 0, "Out of memory.");
+        hist_free(&fc_hist);
+    }
+
+    check(outbuf_flush(out) == 0, "Error writing output.");
+    outbuf_free(out);
+    bufpool_drain();
+
+    return (count_only || max_errors) ? status : 0;
 
 error:
+    outbuf_flush(out);
     return -1;
 }
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "util/bufpool.h"
+
+// Each block starts with its usable size:
+typedef union bufpool_hdr {
+    size_t size;
+    long double align;
+    void *ptr;
+} bufpool_hdr;
+
+static __thread bufpool_hdr *kept[BUFPOOL_KEEP];
+static __thread int nkept = 0;
+
+static void *bufpool_alloc(size_t size)
+{
+    int best = -1;
+
+    // The smallest kept block that is big enough:
+    for (int i = 0; i < nkept; i++) {
+        if (kept[i]->size >= size && (best < 0 || kept[i]->size < kept[best]->size)) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        bufpool_hdr *h = kept[best];
+        kept[best] = kept[--nkept];
+        return h + 1;
+    }
+
+    if (size > SIZE_MAX - sizeof(bufpool_hdr)) return NULL;
+    bufpool_hdr *h = malloc(sizeof(bufpool_hdr) + size);
+    if (h == NULL) return NULL;
+    h->size = size;
+    return h + 1;
+}
+
+void *bufpool_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) return bufpool_alloc(size);
+
+    bufpool_hdr *h = (bufpool_hdr *)ptr - 1;
+    if (size <= h->size) return ptr;
+
+    if (size > SIZE_MAX - sizeof(bufpool_hdr)) return NULL;
+    h = realloc(h, sizeof(bufpool_hdr) + size);
+    if (h == NULL) return NULL;
+    h->size = size;
+    return h + 1;
+}
+
+void bufpool_free(void *ptr)
+{
+    if (ptr == NULL) return;
+
+    bufpool_hdr *h = (bufpool_hdr *)ptr - 1;
+    if (nkept < BUFPOOL_KEEP) {
+        kept[nkept++] = h;
+        return;
+    }
+
+    // Full: keep the bigger blocks, they're the expensive ones to regrow.
+    int smallest = 0;
+    for (int i = 1; i < nkept; i++) {
+        if (kept[i]->size < kept[smallest]->size) smallest = i;
+    }
+    if (kept[smallest]->size < h->size) {
+        bufpool_hdr *t = kept[smallest];
+        kept[smallest] = h;
+        h = t;
+    }
+    free(h);
+}
+
+void bufpool_drain(void)
+{
+    while (nkept > 0) {
+        free(kept[--nkept]);
+    }
+}
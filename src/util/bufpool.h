@@ -0,0 +1,18 @@
+#ifndef __bufpool_h__
+#define __bufpool_h__
+
+#include <stddef.h>
+
+#define BUFPOOL_KEEP 4      // Freed blocks kept for reuse, per thread
+
+// A realloc()/free() pair that keeps freed blocks around (per thread) and
+// hands them out again, so buffers grown for one file or record (such as
+// libcsv's entry_buf) are reused by the next instead of regrown.  Blocks
+// never shrink; only pass blocks from bufpool_realloc() to these functions.
+void *bufpool_realloc(void *ptr, size_t size);
+void bufpool_free(void *ptr);
+
+// Free the blocks kept by the calling thread.
+void bufpool_drain(void);
+
+#endif
@@ -18,6 +18,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #include <assert.h>
+#include <string.h>
 
 #if __STDC_VERSION__ >= 199901L
 #  include <stdint.h>
@@ -27,6 +28,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "csv.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#  include <immintrin.h>
+#  define COUNT_X86 1
+#endif
+
 #define VERSION "3.0.3"
 
 #define ROW_NOT_BEGUN           0
@@ -46,29 +52,87 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define MEM_BLK_SIZE 128
 
+/*
+  States of the count-only parser (csv_count), which follows the same
+  state machine as csv_parse but never looks at field contents.  The
+  FIELD_BEGUN and FIELD_MIGHT_HAVE_ENDED states are split by the quoted
+  flag and by whether spaces followed the quote, since those decide what
+  the next character means.
+*/
+#define COUNT_ROW_NOT_BEGUN     0
+#define COUNT_FIELD_NOT_BEGUN   1
+#define COUNT_UNQUOTED          2  /* FIELD_BEGUN, !quoted */
+#define COUNT_QUOTED            3  /* FIELD_BEGUN, quoted */
+#define COUNT_QUOTE_SEEN        4  /* FIELD_MIGHT_HAVE_ENDED, !spaces */
+#define COUNT_QUOTE_SPACES      5  /* FIELD_MIGHT_HAVE_ENDED, spaces */
+#define COUNT_STATES            6
+
+/* Actions of a count table entry, above the next state */
+#define COUNT_STATE_MASK  0x07
+#define COUNT_FIELD       0x08  /* A field ended */
+#define COUNT_ROW         0x10  /* A row ended at this character */
+#define COUNT_SKIP        0x20  /* An empty line was skipped */
+#define COUNT_ERROR       0x40  /* Parse error in strict mode */
+#define COUNT_NEWLINE     0x80  /* A newline became part of a field */
+
+/* Structural scanners csv_count can use for 64-byte blocks */
+#define COUNT_SIMD_NONE    0
+#define COUNT_SIMD_AVX2    1
+#define COUNT_SIMD_AVX512  2
+
 #define SUBMIT_FIELD(p) \
   do { \
    if (!quoted) \
      entry_pos -= spaces; \
-   if (p->options & CSV_APPEND_NULL) \
-     ((p)->entry_buf[entry_pos]) = '\0'; \
-   if (cb1 && (p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
+   if (options & CSV_APPEND_NULL) \
+     (entry_buf[entry_pos]) = '\0'; \
+   if (cb1 && (options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
      cb1(NULL, entry_pos, data); \
    else if (cb1) \
-     cb1(p->entry_buf, entry_pos, data); \
+     cb1((zero_copy && field) ? (void *)field : entry_buf, entry_pos, data); \
    pstate = FIELD_NOT_BEGUN; \
    entry_pos = quoted = spaces = 0; \
+   field = NULL; \
  } while (0)
 
 #define SUBMIT_ROW(p, c) \
   do { \
+    (p)->row_end = (p)->offset + pos - (pos > 0); /* before c, if any */ \
     if (cb2) \
       cb2(c, data); \
+    (p)->row_start = (p)->offset + pos; \
     pstate = ROW_NOT_BEGUN; \
     entry_pos = quoted = spaces = 0; \
   } while (0)
 
-#define SUBMIT_CHAR(p, c) ((p)->entry_buf[entry_pos++] = (c))
+#define SUBMIT_CHAR(p, c) ((zero_copy && field) ? (void)entry_pos++ : (void)(entry_buf[entry_pos++] = (c)))
+
+/* Copy a field left in the input into entry_buf, which SUBMIT_CHAR uses from
+   then on; if that fails, hand the whole field back (from its opening quote,
+   if any) in the state saved before it began */
+#define KEEP_FIELD(p) \
+  do { \
+    if (zero_copy && field) { \
+      if (csv_copy_field(p, field, entry_pos) != 0) { \
+        size_t at = (size_t)(field - us) - quoted; \
+        p->quoted = 0, p->pstate = field_pstate, p->spaces = 0, p->entry_pos = 0, p->offset += at; \
+        return at; \
+      } \
+      field = NULL; \
+      entry_buf = p->entry_buf; \
+      entry_max = p->entry_size; \
+    } \
+  } while (0)
+
+/* Space and terminator tests of csv_parse_impl; custom is a constant there */
+#define IS_SPACE(c) (custom && is_space ? is_space(c) : (c) == CSV_SPACE || (c) == CSV_TAB)
+#define IS_TERM(c) (custom && is_term ? is_term(c) : (c) == CSV_CR || (c) == CSV_LF)
+
+#if defined(__GNUC__)
+#  define CSV_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#  define CSV_ALWAYS_INLINE
+#endif
 
 static const char *csv_errors[] = {"success",
                              "error parsing data while strict checking enabled",
@@ -139,6 +203,12 @@ csv_init(struct csv_parser *p, unsigned char options)
   p->malloc_func = NULL;
   p->realloc_func = realloc;
   p->free_func = free;
+  p->offset = 0;
+  p->row_start = 0;
+  p->row_end = 0;
+  p->fields = 0;
+  p->newlines = 0;
+  p->count_tbl = NULL;
 
   return 0;
 }
@@ -153,8 +223,12 @@ csv_free(struct csv_parser *p)
   if (p->entry_buf && p->free_func)
     p->free_func(p->entry_buf);
 
+  if (p->count_tbl && p->free_func)
+    p->free_func(p->count_tbl);
+
   p->entry_buf = NULL;
   p->entry_size = 0;
+  p->count_tbl = NULL;
 
   return;
 }
@@ -170,6 +244,11 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
+  unsigned char *entry_buf = p->entry_buf;
+  unsigned char options = p->options;
+  const int zero_copy = 0;  /* Fields are always in entry_buf between calls */
+  const unsigned char *field = NULL;
+  size_t pos = 0;  /* No more input; rows end at p->offset */
 
   if ((pstate == FIELD_BEGUN) && p->quoted && (p->options & CSV_STRICT) && (p->options & CSV_STRICT_FINI)) {
     /* Current field is quoted, no end-quote was seen, and CSV_STRICT_FINI is set */
@@ -198,6 +277,7 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
   /* Reset parser */
   p->spaces = p->quoted = p->entry_pos = p->status = 0;
   p->pstate = ROW_NOT_BEGUN;
+  p->offset = p->row_start = p->row_end = 0;
 
   return 0;
 }
@@ -269,6 +349,16 @@ csv_set_blk_size(struct csv_parser *p, size_t size)
   if (p) p->blk_size = size;
 }
 
+void
+csv_get_row_span(const struct csv_parser *p, size_t *start, size_t *end)
+{
+  /* Get the input offsets of the row being submitted to cb2 */
+  if (p) {
+    *start = p->row_start;
+    *end = p->row_end;
+  }
+}
+
 size_t
 csv_get_buffer_size(const struct csv_parser *p)
 {
@@ -284,13 +374,14 @@ csv_increase_buffer(struct csv_parser *p)
   if (p == NULL) return 0;
   if (p->realloc_func == NULL) return 0;
   
-  /* Increase the size of the entry buffer.  Attempt to increase size by 
-   * p->blk_size, if this is larger than SIZE_MAX try to increase current
+  /* Increase the size of the entry buffer.  Attempt to double it (adding
+   * at least p->blk_size), so that long fields cost a logarithmic number
+   * of reallocations, if this is larger than SIZE_MAX try to increase current
    * buffer size to SIZE_MAX.  If allocation fails, try to allocate halve 
    * the size and try again until successful or increment size is zero.
    */
 
-  size_t to_add = p->blk_size;
+  size_t to_add = p->entry_size > p->blk_size ? p->entry_size : p->blk_size;
   void *vp;
 
   if ( p->entry_size >= SIZE_MAX - to_add )
@@ -315,13 +406,27 @@ csv_increase_buffer(struct csv_parser *p)
   return 0;
 }
  
-size_t
-csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+static int
+csv_copy_field(struct csv_parser *p, const unsigned char *field, size_t len)
 {
-  assert(p && "received null csv_parser");
+  /* Move the first len bytes of a field still in the input into entry_buf */
+  while (p->entry_size < len)
+    if (csv_increase_buffer(p) != 0)
+      return -1;
 
-  if (s == NULL) return 0;
-  
+  memcpy(p->entry_buf, field, len);
+  return 0;
+}
+
+/*
+  The parser proper.  It is instantiated below with options and custom (whether
+  is_space/is_term may be set) as constants for the common dialects, so those
+  variants test no options and call no functions per character.
+*/
+static CSV_ALWAYS_INLINE size_t
+csv_parse_impl(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+               const unsigned char options, const int custom)
+{
   unsigned const char *us = s;  /* Access input data as array of unsigned char */
   unsigned char c;              /* The character we are currently processing */
   size_t pos = 0;               /* The number of characters we have processed in this call */
@@ -335,23 +440,55 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
-
+  unsigned char *entry_buf = p->entry_buf;
+  /* Where the buffer is full, leaving room for a NUL with CSV_APPEND_NULL */
+  size_t entry_max = (options & CSV_APPEND_NULL) ? p->entry_size - 1 : p->entry_size;
+  /* With CSV_ZERO_COPY, a field begun in this call stays in the input (at
+     field) until a doubled quote or the end of the input moves it */
+  const int zero_copy = (options & CSV_ZERO_COPY) && !(options & CSV_APPEND_NULL);
+  const unsigned char *field = NULL;
+  int field_pstate = ROW_NOT_BEGUN;  /* pstate from before field began */
 
   if (!p->entry_buf && pos < len) {
     /* Buffer hasn't been allocated yet and len > 0 */
     if (csv_increase_buffer(p) != 0) { 
-      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->offset += pos;
       return pos;
     }
+    entry_buf = p->entry_buf;
+    entry_max = (options & CSV_APPEND_NULL) ? p->entry_size - 1 : p->entry_size;
   }
 
   while (pos < len) {
     /* Check memory usage, increase buffer if necessary */
-    if (entry_pos == ((p->options & CSV_APPEND_NULL) ? p->entry_size - 1 : p->entry_size) ) {
+    if (entry_pos == entry_max && !(zero_copy && field)) {
       if (csv_increase_buffer(p) != 0) {
-        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->offset += pos;
         return pos;
       }
+      entry_buf = p->entry_buf;
+      entry_max = (options & CSV_APPEND_NULL) ? p->entry_size - 1 : p->entry_size;
+    }
+
+    if (zero_copy && field && pstate == FIELD_BEGUN) {
+      /* Nothing is copied, so skip the bytes that would only be appended:
+         all but quotes in a quoted field, and in an unquoted one all but
+         the characters any state above treats specially */
+      size_t from = pos;
+      if (quoted) {
+        const unsigned char *q = memchr(us + pos, quote, len - pos);
+        pos = q ? (size_t)(q - us) : len;
+      } else if (!custom) {
+        while (pos < len && us[pos] != delim && us[pos] != quote && us[pos] != CSV_CR && us[pos] != CSV_LF
+               && us[pos] != CSV_SPACE && us[pos] != CSV_TAB)
+          pos++;
+      }
+      if (pos > from) {
+        entry_pos += pos - from;
+        spaces = 0;
+        if (pos == len)
+          break;
+      }
     }
 
     c = us[pos++];
@@ -359,16 +496,18 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
     switch (pstate) {
       case ROW_NOT_BEGUN:
       case FIELD_NOT_BEGUN:
-        if ((is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) && c!=delim) { /* Space or Tab */
+        if (IS_SPACE(c) && c!=delim) { /* Space or Tab */
           continue;
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) { /* Carriage Return or Line Feed */
+        } else if (IS_TERM(c)) { /* Carriage Return or Line Feed */
           if (pstate == FIELD_NOT_BEGUN) {
             SUBMIT_FIELD(p);
             SUBMIT_ROW(p, c); 
           } else {  /* ROW_NOT_BEGUN */
             /* Don't submit empty rows by default */
-            if (p->options & CSV_REPALL_NL) {
+            if (options & CSV_REPALL_NL) {
               SUBMIT_ROW(p, c);
+            } else {
+              p->row_start = p->offset + pos;
             }
           }
           continue;
@@ -376,9 +515,11 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
           SUBMIT_FIELD(p);
           break;
         } else if (c == quote) { /* Quote */
+          if (zero_copy) field = us + pos, field_pstate = pstate;
           pstate = FIELD_BEGUN;
           quoted = 1;
         } else {               /* Anything else */
+          if (zero_copy) field = us + pos - 1, field_pstate = pstate;
           pstate = FIELD_BEGUN;
           quoted = 0;
           SUBMIT_CHAR(p, c);
@@ -391,9 +532,10 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
             pstate = FIELD_MIGHT_HAVE_ENDED;
           } else {
             /* STRICT ERROR - double quote inside non-quoted field */
-            if (p->options & CSV_STRICT) {
+            if (options & CSV_STRICT) {
+              KEEP_FIELD(p);
               p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->offset += pos-1;
               return pos-1;
             }
             SUBMIT_CHAR(p, c);
@@ -405,14 +547,14 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
           } else {
             SUBMIT_FIELD(p);
           }
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
+        } else if (IS_TERM(c)) {  /* Carriage Return or Line Feed */
           if (!quoted) {
             SUBMIT_FIELD(p);
             SUBMIT_ROW(p, c);
           } else {
             SUBMIT_CHAR(p, c);
           }
-        } else if (!quoted && (is_space? is_space(c) : c == CSV_SPACE || c == CSV_TAB)) { /* Tab or space for non-quoted field */
+        } else if (!quoted && IS_SPACE(c)) { /* Tab or space for non-quoted field */
             SUBMIT_CHAR(p, c);
             spaces++;
         } else {  /* Anything else */
@@ -425,32 +567,35 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
         if (c == delim) {  /* Comma */
           entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
           SUBMIT_FIELD(p);
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
+        } else if (IS_TERM(c)) {  /* Carriage Return or Line Feed */
           entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
           SUBMIT_FIELD(p);
           SUBMIT_ROW(p, c);
-        } else if (is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) {  /* Space or Tab */
+        } else if (IS_SPACE(c)) {  /* Space or Tab */
           SUBMIT_CHAR(p, c);
           spaces++;
         } else if (c == quote) {  /* Quote */
           if (spaces) {
             /* STRICT ERROR - unescaped double quote */
-            if (p->options & CSV_STRICT) {
+            if (options & CSV_STRICT) {
+              KEEP_FIELD(p);
               p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->offset += pos-1;
               return pos-1;
             }
             spaces = 0;
             SUBMIT_CHAR(p, c);
           } else {
-            /* Two quotes in a row */
+            /* Two quotes in a row; the second isn't part of the field */
+            KEEP_FIELD(p);
             pstate = FIELD_BEGUN;
           }
         } else {  /* Anything else */
           /* STRICT ERROR - unescaped double quote */
-          if (p->options & CSV_STRICT) {
+          if (options & CSV_STRICT) {
+            KEEP_FIELD(p);
             p->status = CSV_EPARSE;
-            p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+            p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->offset += pos-1;
             return pos-1;
           }
           pstate = FIELD_BEGUN;
@@ -462,10 +607,610 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
        break;
     }
   }
-  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  KEEP_FIELD(p);
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->offset += pos;
   return pos;
 }
 
+size_t
+csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  assert(p && "received null csv_parser");
+
+  if (s == NULL) return 0;
+
+  /* Options and the space/terminator functions can change between calls
+     (through the csv_set_* functions), so the variant is picked per call */
+  if (p->is_space == NULL && p->is_term == NULL) {
+    if (p->options == 0)
+      return csv_parse_impl(p, s, len, cb1, cb2, data, 0, 0);
+    if (p->options == CSV_STRICT)
+      return csv_parse_impl(p, s, len, cb1, cb2, data, CSV_STRICT, 0);
+    if (p->options == CSV_ZERO_COPY)
+      return csv_parse_impl(p, s, len, cb1, cb2, data, CSV_ZERO_COPY, 0);
+  }
+  return csv_parse_impl(p, s, len, cb1, cb2, data, p->options, 1);
+}
+
+static int
+csv_count_space(const struct csv_parser *p, unsigned char c)
+{
+  return p->is_space ? p->is_space(c) : c == CSV_SPACE || c == CSV_TAB;
+}
+
+static int
+csv_count_term(const struct csv_parser *p, unsigned char c)
+{
+  return p->is_term ? p->is_term(c) : c == CSV_CR || c == CSV_LF;
+}
+
+static unsigned char
+csv_count_step(const struct csv_parser *p, int state, unsigned char c)
+{
+  /* What csv_parse does with c in the given state, tested in the same order */
+  int strict = p->options & CSV_STRICT;
+
+  switch (state) {
+    case COUNT_ROW_NOT_BEGUN:
+    case COUNT_FIELD_NOT_BEGUN:
+      if (csv_count_space(p, c) && c != p->delim_char)
+        return state;
+      if (csv_count_term(p, c)) {
+        if (state == COUNT_FIELD_NOT_BEGUN)
+          return COUNT_ROW_NOT_BEGUN | COUNT_FIELD | COUNT_ROW;
+        if (p->options & CSV_REPALL_NL)
+          return COUNT_ROW_NOT_BEGUN | COUNT_ROW;
+        return COUNT_ROW_NOT_BEGUN | COUNT_SKIP;
+      }
+      if (c == p->delim_char)
+        return COUNT_FIELD_NOT_BEGUN | COUNT_FIELD;
+      if (c == p->quote_char)
+        return COUNT_QUOTED;
+      return COUNT_UNQUOTED;
+    case COUNT_UNQUOTED:
+      if (c == p->quote_char)
+        return strict ? COUNT_UNQUOTED | COUNT_ERROR : COUNT_UNQUOTED;
+      if (c == p->delim_char)
+        return COUNT_FIELD_NOT_BEGUN | COUNT_FIELD;
+      if (csv_count_term(p, c))
+        return COUNT_ROW_NOT_BEGUN | COUNT_FIELD | COUNT_ROW;
+      return COUNT_UNQUOTED;
+    case COUNT_QUOTED:
+      if (c == p->quote_char)
+        return COUNT_QUOTE_SEEN;
+      return COUNT_QUOTED;
+    case COUNT_QUOTE_SEEN:
+    case COUNT_QUOTE_SPACES:
+      if (c == p->delim_char)
+        return COUNT_FIELD_NOT_BEGUN | COUNT_FIELD;
+      if (csv_count_term(p, c))
+        return COUNT_ROW_NOT_BEGUN | COUNT_FIELD | COUNT_ROW;
+      if (csv_count_space(p, c))
+        return COUNT_QUOTE_SPACES;
+      if (c == p->quote_char) {
+        if (state == COUNT_QUOTE_SPACES)
+          return strict ? state | COUNT_ERROR : COUNT_QUOTE_SEEN;
+        return COUNT_QUOTED;
+      }
+      return strict ? state | COUNT_ERROR : COUNT_QUOTED;
+  }
+
+  return state;
+}
+
+static int
+csv_count_simd(const struct csv_parser *p)
+{
+  /* The block scanner knows the default space and terminator sets only,
+     needs the dialect characters to be told apart, and never reports
+     empty lines */
+  unsigned char d = p->delim_char, q = p->quote_char;
+
+  if (p->is_space || p->is_term || (p->options & CSV_REPALL_NL))
+    return COUNT_SIMD_NONE;
+  if (d == q || d == CSV_CR || d == CSV_LF
+      || q == CSV_CR || q == CSV_LF || q == CSV_SPACE || q == CSV_TAB)
+    return COUNT_SIMD_NONE;
+#ifdef COUNT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt"))
+    return COUNT_SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    return COUNT_SIMD_AVX2;
+#endif
+  return COUNT_SIMD_NONE;
+}
+
+static int
+csv_count_table(struct csv_parser *p)
+{
+  /* Build (or reuse) the transition table for the current settings */
+  int state, c;
+
+  if (p->count_tbl && p->count_delim == p->delim_char && p->count_quote == p->quote_char
+      && p->count_options == p->options && p->count_space == p->is_space && p->count_term == p->is_term)
+    return 0;
+
+  if (p->count_tbl == NULL) {
+    if (p->realloc_func == NULL ||
+        (p->count_tbl = p->realloc_func(NULL, COUNT_STATES * 256)) == NULL) {
+      p->status = CSV_ENOMEM;
+      return -1;
+    }
+  }
+
+  for (state = 0; state < COUNT_STATES; state++)
+    for (c = 0; c < 256; c++) {
+      unsigned char a = csv_count_step(p, state, (unsigned char)c);
+      int next = a & COUNT_STATE_MASK;
+      if (c == '\n' && !(a & COUNT_ERROR) && (next == COUNT_QUOTED || next == COUNT_UNQUOTED))
+        a |= COUNT_NEWLINE;
+      p->count_tbl[state * 256 + c] = a;
+    }
+
+  p->count_delim = p->delim_char;
+  p->count_quote = p->quote_char;
+  p->count_options = p->options;
+  p->count_space = p->is_space;
+  p->count_term = p->is_term;
+  p->count_simd = csv_count_simd(p);
+  return 0;
+}
+
+static int
+csv_count_load(const struct csv_parser *p)
+{
+  /* Map the csv_parse state onto a count state */
+  switch (p->pstate) {
+    case FIELD_NOT_BEGUN:
+      return COUNT_FIELD_NOT_BEGUN;
+    case FIELD_BEGUN:
+      return p->quoted ? COUNT_QUOTED : COUNT_UNQUOTED;
+    case FIELD_MIGHT_HAVE_ENDED:
+      return p->spaces ? COUNT_QUOTE_SPACES : COUNT_QUOTE_SEEN;
+  }
+  return COUNT_ROW_NOT_BEGUN;
+}
+
+static void
+csv_count_store(struct csv_parser *p, int state)
+{
+  /* Map a count state back onto the csv_parse state */
+  static const int pstates[COUNT_STATES] = {ROW_NOT_BEGUN, FIELD_NOT_BEGUN, FIELD_BEGUN,
+                                            FIELD_BEGUN, FIELD_MIGHT_HAVE_ENDED, FIELD_MIGHT_HAVE_ENDED};
+  p->pstate = pstates[state];
+  p->quoted = state >= COUNT_QUOTED;
+  p->spaces = state == COUNT_QUOTE_SPACES;
+}
+
+/* Where csv_count and csv_count_batch send the rows they find */
+struct csv_count_sink {
+  void (*cb)(const struct csv_row *, void *);
+  void *data;
+  struct csv_batch *b;      /* Rows go here instead of to cb when set */
+};
+
+static CSV_ALWAYS_INLINE void
+csv_count_row(struct csv_parser *p, const struct csv_count_sink *out, size_t end, size_t fields,
+              size_t newlines)
+{
+  struct csv_row row;
+  struct csv_batch *b = out->b;
+
+  row.start = p->row_start;
+  row.end = end;
+  row.fields = fields;
+  row.newlines = newlines;
+  if (b) {
+    row.first = b->ends ? b->nends - fields : 0;
+    b->rows[b->nrows++] = row;
+  } else {
+    row.first = 0;
+    if (out->cb)
+      out->cb(&row, out->data);
+  }
+}
+
+static size_t
+csv_count_room(const struct csv_count_sink *out)
+{
+  /* Bytes that can be counted before the batch may run out of room: each
+     ends at most one field and one row */
+  const struct csv_batch *b = out->b;
+  size_t room;
+
+  if (b == NULL)
+    return SIZE_MAX;
+  room = b->max_rows - b->nrows;
+  if (b->ends && b->max_ends - b->nends < room)
+    room = b->max_ends - b->nends;
+  return room;
+}
+
+static int
+csv_count_run(struct csv_parser *p, const unsigned char *us, size_t *posp, size_t end, int *statep,
+              size_t *fieldsp, const struct csv_count_sink *out)
+{
+  /* Step the transition table over us[*posp, end) */
+  const unsigned char *tbl = p->count_tbl;
+  size_t *ends = out->b ? out->b->ends : NULL;
+  size_t pos = *posp;
+  size_t fields = *fieldsp;
+  size_t newlines = p->newlines;
+  int state = *statep;
+  int ret = 0;
+
+  for (; pos < end; pos++) {
+    unsigned char a = tbl[state * 256 + us[pos]];
+
+    state = a & COUNT_STATE_MASK;
+    fields += (a & COUNT_FIELD) != 0;
+    newlines += a >> 7;
+    if (ends && (a & COUNT_FIELD))
+      ends[out->b->nends++] = p->offset + pos;
+
+    if (a & (COUNT_ROW | COUNT_SKIP | COUNT_ERROR)) {
+      if (a & COUNT_ERROR) {
+        p->status = CSV_EPARSE;
+        ret = -1;
+        break;
+      }
+      if (a & COUNT_ROW) {
+        csv_count_row(p, out, p->offset + pos, fields, newlines);
+        fields = newlines = 0;
+      }
+      p->row_start = p->offset + pos + 1;
+    }
+  }
+
+  p->newlines = newlines;
+  *posp = pos;
+  *statep = state;
+  *fieldsp = fields;
+  return ret;
+}
+
+#ifdef COUNT_X86
+
+/*
+  Structural scanning of 64-byte blocks, in the style of simdjson: the
+  block is reduced to bitmasks of quotes (q), delimiters (d), terminators
+  (t) and spaces (s, without the delimiter), and a prefix XOR of the quote
+  mask gives the bytes inside quotes (in).  Delimiters and terminators
+  outside quotes then end fields and rows without visiting each byte;
+  terminators inside quotes are looked at only to count the newlines.
+
+  This only agrees with the state machine when every quote does what the
+  XOR assumes: an opening quote must start a field (follow a delimiter,
+  terminator or closing quote, or begin the block where a field may start)
+  and a closing quote must end one (be followed by a delimiter, terminator
+  or another quote, or end the block).  Blocks where that fails, such as
+  quotes inside unquoted fields or spaces around quoted ones, return -1 and
+  are left to the table.
+*/
+static CSV_ALWAYS_INLINE int
+csv_count_block(struct csv_parser *p, const unsigned char *blk, uint64_t q, uint64_t d, uint64_t t,
+                uint64_t s, size_t base, int *statep, size_t *fieldsp, const struct csv_count_sink *out)
+{
+  size_t *ends = out->b ? out->b->ends : NULL;
+  uint64_t in = q, open, close, term, nl, done = 0, rest, m;
+  size_t fields = *fieldsp;
+  int state = *statep;
+
+  in ^= in << 1;
+  in ^= in << 2;
+  in ^= in << 4;
+  in ^= in << 8;
+  in ^= in << 16;
+  in ^= in << 32;
+  if (state == COUNT_QUOTED)
+    in = ~in;
+
+  open = q & in;
+  close = q & ~in;
+  if (open & ~(((d | t | close) << 1) | (state <= COUNT_FIELD_NOT_BEGUN)))
+    return -1;
+  if (close & ~(((d | t | q) >> 1) | (1ull << 63)))
+    return -1;
+
+  /* Carriage returns are terminators too, but not newlines */
+  for (nl = m = t & in; m; m &= m - 1)
+    if (blk[__builtin_ctzll(m)] != '\n')
+      nl &= ~(m & -m);
+
+  d &= ~in;
+  term = t &= ~in;
+  for (; t; t &= t - 1) {
+    int b = __builtin_ctzll(t);
+    uint64_t upto = (2ull << b) - 1;
+    uint64_t seg = upto & ~done;
+
+    /* Lines of nothing but spaces are skipped, like empty ones */
+    if (state != COUNT_ROW_NOT_BEGUN || (seg & ~(s | term))) {
+      if (ends) {
+        for (m = d & seg; m; m &= m - 1)
+          ends[out->b->nends++] = base + __builtin_ctzll(m);
+        ends[out->b->nends++] = base + b;
+      }
+      csv_count_row(p, out, base + b, fields + __builtin_popcountll(d & seg) + 1,
+                    p->newlines + __builtin_popcountll(nl & seg));
+    }
+    fields = p->newlines = 0;
+    p->row_start = base + b + 1;
+    state = COUNT_ROW_NOT_BEGUN;
+    done = upto;
+  }
+  fields += __builtin_popcountll(d & ~done);
+  p->newlines += __builtin_popcountll(nl & ~done);
+  if (ends)
+    for (m = d & ~done; m; m &= m - 1)
+      ends[out->b->nends++] = base + __builtin_ctzll(m);
+
+  /* The state after the block follows from its last byte that isn't a space */
+  rest = ~s;
+  if (in >> 63)
+    state = COUNT_QUOTED;
+  else if (close >> 63)
+    state = COUNT_QUOTE_SEEN;
+  else if (rest) {
+    int b = 63 - __builtin_clzll(rest);
+    if ((term >> b) & 1)
+      state = COUNT_ROW_NOT_BEGUN;
+    else if ((d >> b) & 1)
+      state = COUNT_FIELD_NOT_BEGUN;
+    else
+      state = COUNT_UNQUOTED;
+  }
+
+  *statep = state;
+  *fieldsp = fields;
+  return 0;
+}
+
+/*
+  Feed 64-byte blocks to csv_count_block() while the state is one it can
+  start from.  Irregular blocks go to the table whole; after a closing
+  quote at the end of a block a single byte settles what it meant.  A
+  batch with less room than a block holds is handed back rather than
+  filled up slowly by the table.
+*/
+#define COUNT_SIMD_LOOP(MASKS)                                                  \
+  const unsigned char dc = p->delim_char, qc = p->quote_char;                   \
+  size_t pos = 0;                                                               \
+                                                                                \
+  while (pos < len) {                                                           \
+    size_t end = len;                                                           \
+    size_t room = csv_count_room(out);                                          \
+    if (room == 0 || (room < 64 && len - pos >= 64 && out->b->nrows > 0))       \
+      break;                                                                    \
+    if (len - pos >= 64) {                                                      \
+      if (*statep <= COUNT_QUOTED && room >= 64) {                              \
+        uint64_t q, d, t, s;                                                    \
+        MASKS(us + pos, dc, qc, &q, &d, &t, &s);                                \
+        if (csv_count_block(p, us + pos, q, d, t, s, p->offset + pos, statep,   \
+                            fieldsp, out) == 0) {                               \
+          pos += 64;                                                            \
+          continue;                                                             \
+        }                                                                       \
+        end = pos + 64;                                                         \
+      }                                                                         \
+      else                                                                      \
+        end = pos + 1;                                                          \
+    }                                                                           \
+    if (end - pos > room)                                                       \
+      end = pos + room;                                                         \
+    if (csv_count_run(p, us, &pos, end, statep, fieldsp, out) != 0)             \
+      break;                                                                    \
+  }                                                                             \
+  return pos
+
+#define COUNT_EQ_AVX2(lo, hi, c)                                                \
+  ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, _mm256_set1_epi8((char)(c)))) \
+   | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)(c)))) << 32)
+
+__attribute__((target("avx2")))
+static inline void
+csv_count_masks_avx2(const unsigned char *us, unsigned char dc, unsigned char qc,
+                     uint64_t *q, uint64_t *d, uint64_t *t, uint64_t *s)
+{
+  __m256i lo = _mm256_loadu_si256((const __m256i *)us);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(us + 32));
+
+  *q = COUNT_EQ_AVX2(lo, hi, qc);
+  *d = COUNT_EQ_AVX2(lo, hi, dc);
+  *t = COUNT_EQ_AVX2(lo, hi, CSV_CR) | COUNT_EQ_AVX2(lo, hi, CSV_LF);
+  *s = (COUNT_EQ_AVX2(lo, hi, CSV_SPACE) | COUNT_EQ_AVX2(lo, hi, CSV_TAB)) & ~*d;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void
+csv_count_masks_avx512(const unsigned char *us, unsigned char dc, unsigned char qc,
+                       uint64_t *q, uint64_t *d, uint64_t *t, uint64_t *s)
+{
+  __m512i v = _mm512_loadu_si512((const void *)us);
+
+  *q = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8((char)qc));
+  *d = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8((char)dc));
+  *t = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(CSV_CR)) | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(CSV_LF));
+  *s = (_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(CSV_SPACE)) | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(CSV_TAB))) & ~*d;
+}
+
+__attribute__((target("avx2,popcnt,bmi,lzcnt")))
+static size_t
+csv_count_avx2(struct csv_parser *p, const unsigned char *us, size_t len, int *statep, size_t *fieldsp,
+               const struct csv_count_sink *out)
+{
+  COUNT_SIMD_LOOP(csv_count_masks_avx2);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt,bmi,lzcnt")))
+static size_t
+csv_count_avx512(struct csv_parser *p, const unsigned char *us, size_t len, int *statep, size_t *fieldsp,
+                 const struct csv_count_sink *out)
+{
+  COUNT_SIMD_LOOP(csv_count_masks_avx512);
+}
+
+#endif
+
+static size_t
+csv_count_sinks(struct csv_parser *p, const void *s, size_t len, const struct csv_count_sink *out)
+{
+  unsigned const char *us = s;
+  size_t pos = 0;
+  size_t fields = p->fields;
+  int state = csv_count_load(p);
+
+  if (csv_count_table(p) != 0)
+    return 0;
+
+  switch (p->count_simd) {
+#ifdef COUNT_X86
+    case COUNT_SIMD_AVX512:
+      pos = csv_count_avx512(p, us, len, &state, &fields, out);
+      break;
+    case COUNT_SIMD_AVX2:
+      pos = csv_count_avx2(p, us, len, &state, &fields, out);
+      break;
+#endif
+    default:
+      while (pos < len) {
+        size_t room = csv_count_room(out);
+        size_t end = (len - pos > room) ? pos + room : len;
+        if (room == 0 || csv_count_run(p, us, &pos, end, &state, &fields, out) != 0)
+          break;
+      }
+      break;
+  }
+
+  csv_count_store(p, state);
+  p->fields = fields;
+  p->offset += pos;
+  return pos;
+}
+
+size_t
+csv_count(struct csv_parser *p, const void *s, size_t len, void (*cb)(const struct csv_row *, void *), void *data)
+{
+  struct csv_count_sink out;
+
+  assert(p && "received null csv_parser");
+
+  if (s == NULL) return 0;
+
+  out.cb = cb;
+  out.data = data;
+  out.b = NULL;
+  return csv_count_sinks(p, s, len, &out);
+}
+
+size_t
+csv_count_batch(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b)
+{
+  struct csv_count_sink out;
+
+  assert(p && "received null csv_parser");
+  assert(b && "received null csv_batch");
+
+  if (s == NULL) return 0;
+
+  out.cb = NULL;
+  out.data = NULL;
+  out.b = b;
+  return csv_count_sinks(p, s, len, &out);
+}
+
+void
+csv_batch_clear(struct csv_batch *b)
+{
+  /* Drop the finished rows, moving the field ends of the unfinished one to the front */
+  size_t keep = 0;
+
+  if (b->nrows > 0 && b->ends) {
+    const struct csv_row *last = &b->rows[b->nrows - 1];
+    keep = last->first + last->fields;
+    memmove(b->ends, b->ends + keep, (b->nends - keep) * sizeof(*b->ends));
+  }
+  b->nends -= keep;
+  b->nrows = 0;
+}
+
+void
+csv_count_start(struct csv_parser *p, size_t offset, int quoted)
+{
+  /* Start counting at input offset offset, either between rows or inside a
+     quoted field of a row that began before it */
+  p->pstate = quoted ? FIELD_BEGUN : ROW_NOT_BEGUN;
+  p->quoted = quoted != 0;
+  p->spaces = 0;
+  p->offset = p->row_start = p->row_end = offset;
+  p->fields = p->newlines = 0;
+}
+
+int
+csv_count_pending(const struct csv_parser *p, size_t *fields)
+{
+  /* What the input so far has left unfinished, and the fields already
+     ended in it */
+  if (fields)
+    *fields = p->fields;
+  if (p->pstate == ROW_NOT_BEGUN)
+    return CSV_PENDING_NONE;
+  if (p->pstate == FIELD_BEGUN && p->quoted)
+    return CSV_PENDING_QUOTED;
+  return CSV_PENDING_ROW;
+}
+
+static int
+csv_count_fini_sinks(struct csv_parser *p, const struct csv_count_sink *out)
+{
+  if (p == NULL)
+    return -1;
+
+  /* Finalize counting.  Needed, for example, when file does not end in a newline */
+  if (p->pstate == FIELD_BEGUN && p->quoted && (p->options & CSV_STRICT) && (p->options & CSV_STRICT_FINI)) {
+    p->status = CSV_EPARSE;
+    return -1;
+  }
+
+  if (p->pstate != ROW_NOT_BEGUN) {
+    if (csv_count_room(out) == 0)
+      return -1;
+    if (out->b && out->b->ends)
+      out->b->ends[out->b->nends++] = p->offset;
+    csv_count_row(p, out, p->offset, p->fields + 1, p->newlines);
+  }
+
+  /* Reset parser */
+  p->spaces = p->quoted = p->entry_pos = p->status = 0;
+  p->pstate = ROW_NOT_BEGUN;
+  p->offset = p->row_start = p->row_end = p->fields = p->newlines = 0;
+
+  return 0;
+}
+
+int
+csv_count_fini(struct csv_parser *p, void (*cb)(const struct csv_row *, void *), void *data)
+{
+  struct csv_count_sink out;
+
+  out.cb = cb;
+  out.data = data;
+  out.b = NULL;
+  return csv_count_fini_sinks(p, &out);
+}
+
+int
+csv_count_batch_fini(struct csv_parser *p, struct csv_batch *b)
+{
+  struct csv_count_sink out;
+
+  out.cb = NULL;
+  out.data = NULL;
+  out.b = b;
+  return csv_count_fini_sinks(p, &out);
+}
+
 size_t
 csv_write (void *dest, size_t dest_size, const void *src, size_t src_size)
 {
@@ -28,7 +28,15 @@ extern "C" {
 #define CSV_APPEND_NULL 8 /* Ensure that all fields are null-terminated */
 #define CSV_EMPTY_IS_NULL 16 /* Pass null pointer to cb1 function when
                                 empty, unquoted fields are encountered */
+#define CSV_ZERO_COPY 32 /* Pass cb1 a pointer into the input, rather than a
+                            copy, for fields that lie in it whole and
+                            need no unescaping; cb1 must not modify it.
+                            Ignored with CSV_APPEND_NULL */
 
+/* What csv_count_pending reports is left unfinished */
+#define CSV_PENDING_NONE 0   /* Between rows */
+#define CSV_PENDING_ROW 1    /* Inside a row */
+#define CSV_PENDING_QUOTED 2 /* Inside a quoted field of a row */
 
 /* Character values */
 #define CSV_TAB    0x09
@@ -55,6 +63,45 @@ struct csv_parser {
   void *(*malloc_func)(size_t);
   void *(*realloc_func)(void *, size_t);
   void (*free_func)(void *);
+  size_t offset;      /* Bytes of input consumed before the current csv_parse call */
+  size_t row_start;   /* Input offset of the first byte of the current row */
+  size_t row_end;     /* Input offset of the end (terminator) of the row passed to cb2 */
+  size_t fields;      /* Fields ended so far in the current row (csv_count) */
+  size_t newlines;    /* Newlines inside its fields so far (csv_count) */
+  unsigned char *count_tbl;   /* Transition table of csv_count */
+  unsigned char count_delim;  /* Settings count_tbl was built for */
+  unsigned char count_quote;
+  unsigned char count_options;
+  unsigned char count_simd;   /* Block scanner usable with those settings */
+  int (*count_space)(unsigned char);
+  int (*count_term)(unsigned char);
+};
+
+/* A row found by csv_count */
+struct csv_row {
+  size_t start;       /* Input offset of the first byte of the row */
+  size_t end;         /* Input offset of its terminator, or the end of input */
+  size_t fields;      /* Number of fields in the row */
+  size_t newlines;    /* Newlines inside its fields */
+  size_t first;       /* Index in csv_batch.ends of the end of its first field */
+};
+
+/*
+  Rows found by csv_count_batch, with the input offset where each of their
+  fields ends (at its delimiter or the row's terminator).  Field i of a row
+  spans the raw input from the end of field i-1 (plus one), or from the
+  row's start, to ends[first + i].  Both arrays are the caller's; ends may
+  be NULL when field offsets aren't wanted.  csv_count_batch stops early
+  once either array is full: handle the rows, csv_batch_clear() them and
+  call again.  If ends fills up without a row finished, make it larger.
+*/
+struct csv_batch {
+  struct csv_row *rows;
+  size_t max_rows;
+  size_t nrows;       /* Rows finished */
+  size_t *ends;
+  size_t max_ends;
+  size_t nends;       /* Field ends recorded, the unfinished row's included */
 };
 
 /* Function Prototypes */
@@ -64,6 +111,13 @@ void csv_free(struct csv_parser *p);
 int csv_error(const struct csv_parser *p);
 const char * csv_strerror(int error);
 size_t csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int, void *), void *data);
+size_t csv_count(struct csv_parser *p, const void *s, size_t len, void (*cb)(const struct csv_row *, void *), void *data);
+int csv_count_fini(struct csv_parser *p, void (*cb)(const struct csv_row *, void *), void *data);
+void csv_count_start(struct csv_parser *p, size_t offset, int quoted);
+size_t csv_count_batch(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b);
+int csv_count_batch_fini(struct csv_parser *p, struct csv_batch *b);
+void csv_batch_clear(struct csv_batch *b);
+int csv_count_pending(const struct csv_parser *p, size_t *fields);
 size_t csv_write(void *dest, size_t dest_size, const void *src, size_t src_size);
 int csv_fwrite(FILE *fp, const void *src, size_t src_size);
 size_t csv_write2(void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char quote);
@@ -80,6 +134,7 @@ void csv_set_realloc_func(struct csv_parser *p, void *(*)(void *, size_t));
 void csv_set_free_func(struct csv_parser *p, void (*)(void *));
 void csv_set_blk_size(struct csv_parser *p, size_t);
 size_t csv_get_buffer_size(const struct csv_parser *p);
+void csv_get_row_span(const struct csv_parser *p, size_t *start, size_t *end);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include "util/hist.h"
+
+#define HIST_MIN_SLOTS 64
+
+void hist_init(hist *h)
+{
+    h->dense = NULL;
+    h->slots = NULL;
+    h->nslots = h->used = 0;
+    h->error = 0;
+}
+
+void hist_free(hist *h)
+{
+    free(h->dense);
+    free(h->slots);
+    hist_init(h);
+}
+
+static size_t hist_hash(uint64_t key, size_t nslots)
+{
+    // Fibonacci hashing; nslots is a power of two:
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (nslots - 1);
+}
+
+// The slot holding key, or the free one where it belongs:
+static hist_slot *hist_find(hist_slot *slots, size_t nslots, uint64_t key)
+{
+    size_t i = hist_hash(key, nslots);
+
+    while (slots[i].count != 0 && slots[i].key != key) {
+        i = (i + 1) & (nslots - 1);
+    }
+    return &slots[i];
+}
+
+// Double the table (or create it), keeping it at most half full:
+static int hist_grow(hist *h)
+{
+    size_t nslots = h->nslots ? h->nslots * 2 : HIST_MIN_SLOTS;
+    hist_slot *slots = calloc(nslots, sizeof(hist_slot));
+    if (slots == NULL) return -1;
+
+    for (size_t i = 0; i < h->nslots; i++) {
+        if (h->slots[i].count != 0) {
+            *hist_find(slots, nslots, h->slots[i].key) = h->slots[i];
+        }
+    }
+
+    free(h->slots);
+    h->slots = slots;
+    h->nslots = nslots;
+    return 0;
+}
+
+void hist_add_slow(hist *h, uint64_t key, uint64_t n)
+{
+    if (n == 0) return;
+
+    if (key < HIST_DENSE) {
+        h->dense = calloc(HIST_DENSE, sizeof(uint64_t));
+        if (h->dense == NULL) goto error;
+        h->dense[key] += n;
+        return;
+    }
+
+    if ((h->used + 1) * 2 > h->nslots && hist_grow(h) != 0) goto error;
+
+    hist_slot *s = hist_find(h->slots, h->nslots, key);
+    if (s->count == 0) {
+        s->key = key;
+        h->used++;
+    }
+    s->count += n;
+    return;
+
+error:
+    h->error = 1;
+}
+
+void hist_merge(hist *dst, const hist *src)
+{
+    if (src->dense != NULL) {
+        for (uint64_t k = 0; k < HIST_DENSE; k++) {
+            hist_add(dst, k, src->dense[k]);
+        }
+    }
+    for (size_t i = 0; i < src->nslots; i++) {
+        if (src->slots[i].count != 0) {
+            hist_add_slow(dst, src->slots[i].key, src->slots[i].count);
+        }
+    }
+    dst->error |= src->error;
+}
+
+static int hist_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const hist_slot *)a)->key;
+    uint64_t y = ((const hist_slot *)b)->key;
+    return (x > y) - (x < y);
+}
+
+int hist_each(const hist *h, int (*fn)(uint64_t key, uint64_t count, void *data), void *data)
+{
+    hist_slot *sorted = NULL;
+    size_t n = 0;
+    int rc = 0;
+
+    if (h->dense != NULL) {
+        for (uint64_t k = 0; k < HIST_DENSE && rc == 0; k++) {
+            if (h->dense[k] != 0) rc = fn(k, h->dense[k], data);
+        }
+    }
+    if (rc != 0 || h->used == 0) return rc;
+
+    // The larger keys are all above the dense ones:
+    sorted = malloc(h->used * sizeof(hist_slot));
+    if (sorted == NULL) return -1;
+    for (size_t i = 0; i < h->nslots; i++) {
+        if (h->slots[i].count != 0) sorted[n++] = h->slots[i];
+    }
+    qsort(sorted, n, sizeof(hist_slot), hist_cmp);
+
+    for (size_t i = 0; i < n && rc == 0; i++) {
+        rc = fn(sorted[i].key, sorted[i].count, data);
+    }
+
+    free(sorted);
+    return rc;
+}
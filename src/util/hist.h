@@ -0,0 +1,47 @@
+#ifndef __hist_h__
+#define __hist_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_DENSE 256      // Keys below this are counted in a plain array
+
+// How many times each key (e.g. a field count) was seen.  Small keys go to a
+// dense array; the rare larger ones to an open-addressing hash table.  A
+// zeroed hist is empty and ready for use.
+typedef struct hist_slot {
+    uint64_t key;
+    uint64_t count;         // 0 for a free slot
+} hist_slot;
+
+typedef struct hist {
+    uint64_t *dense;        // Counts for keys below HIST_DENSE
+    hist_slot *slots;       // Counts for the rest
+    size_t nslots;          // Size of slots, a power of two
+    size_t used;            // Slots taken
+    int error;              // Set once out of memory; counts are incomplete
+} hist;
+
+void hist_init(hist *h);
+void hist_free(hist *h);
+
+// Count key n more times, on the slow path (see hist_add()).
+void hist_add_slow(hist *h, uint64_t key, uint64_t n);
+
+static inline void hist_add(hist *h, uint64_t key, uint64_t n)
+{
+    if (key < HIST_DENSE && h->dense != NULL) {
+        h->dense[key] += n;
+        return;
+    }
+    hist_add_slow(h, key, n);
+}
+
+// Add the counts of src to dst.
+void hist_merge(hist *dst, const hist *src);
+
+// Call fn for every key seen, in increasing order, stopping early if it
+// returns nonzero.  Returns that value, 0 otherwise, or -1 if out of memory.
+int hist_each(const hist *h, int (*fn)(uint64_t key, uint64_t count, void *data), void *data);
+
+#endif
@@ -0,0 +1,58 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util/dbg.h"
+#include "util/mmfile.h"
+
+int mmfile_open(mmfile *m, const char *filename)
+{
+    struct stat st;
+    int fd = -1;
+
+    m->data = NULL;
+    m->size = 0;
+
+    fd = open(filename, O_RDONLY);
+    check(fd != -1, "Error opening file: %s.", filename);
+    check(fstat(fd, &st) == 0, "Error reading status of file: %s.", filename);
+
+    // Only regular files have a size we can trust; everything else streams.
+    // Empty files stream too, since some (e.g. in /proc) only look empty:
+    if (!S_ISREG(st.st_mode) || st.st_size == 0 || (uintmax_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return 1;
+    }
+
+    // A read-only mapping isn't charged against the commit limit, so files
+    // larger than memory map too.  If one still can't be mapped, it streams:
+    m->size = (size_t)st.st_size;
+    m->data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (m->data == MAP_FAILED) {
+        debug("Can't map file: %s; reading it instead.", filename);
+        close(fd);
+        m->data = NULL;
+        m->size = 0;
+        return 1;
+    }
+    madvise(m->data, m->size, MADV_SEQUENTIAL);
+
+    close(fd);
+    return 0;
+
+error:
+    if (fd != -1) close(fd);
+    m->data = NULL;
+    m->size = 0;
+    return -1;
+}
+
+void mmfile_close(mmfile *m)
+{
+    if (m->data != NULL) {
+        munmap(m->data, m->size);
+    }
+    m->data = NULL;
+    m->size = 0;
+}
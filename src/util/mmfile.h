@@ -0,0 +1,23 @@
+#ifndef __mmfile_h__
+#define __mmfile_h__
+
+#include <stddef.h>
+
+// A regular file mapped into memory for in-place scanning.
+//
+// The mapping is read-only: embedded NULs are replaced as records are output,
+// never in the mapping itself.
+typedef struct mmfile {
+    char *data;     // Start of the mapping
+    size_t size;    // Number of mapped bytes
+} mmfile;
+
+// Map filename.  Returns 0 when mapped, 1 when the file can't be mapped
+// (pipes, ttys, or mmap() refused it) and should be read as a stream
+// instead, -1 on error.
+int mmfile_open(mmfile *m, const char *filename);
+
+// Unmap a file mapped with mmfile_open().
+void mmfile_close(mmfile *m);
+
+#endif
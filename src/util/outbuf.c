@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util/dbg.h"
+#include "util/outbuf.h"
+
+#if !defined(IOV_MAX) || IOV_MAX > 1024
+#undef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+int outbuf_init(outbuf *o, int fd, size_t size)
+{
+    o->fd = fd;
+    o->sink = NULL;
+    o->sink_data = NULL;
+    o->len = 0;
+    o->size = size ? size : OUTBUF_SIZE;
+    o->run = 0;
+    o->iovcnt = 0;
+    o->iovmax = IOV_MAX;
+    o->error = 0;
+    o->buf = malloc(o->size);
+    o->iov = malloc(o->iovmax * sizeof(struct iovec));
+    check_mem(o->buf && o->iov);
+
+    return 0;
+
+error:
+    outbuf_free(o);
+    return -1;
+}
+
+void outbuf_set_sink(outbuf *o, int (*sink)(void *data, const void *s, size_t n), void *data)
+{
+    o->sink = sink;
+    o->sink_data = data;
+}
+
+void outbuf_free(outbuf *o)
+{
+    free(o->buf);
+    free(o->iov);
+    o->buf = NULL;
+    o->iov = NULL;
+    o->len = o->size = o->run = 0;
+    o->iovcnt = 0;
+}
+
+// Turn the bytes staged since the last piece into a piece of their own:
+static void outbuf_end_run(outbuf *o)
+{
+    if (o->len > o->run) {
+        o->iov[o->iovcnt].iov_base = o->buf + o->run;
+        o->iov[o->iovcnt].iov_len = o->len - o->run;
+        o->iovcnt++;
+        o->run = o->len;
+    }
+}
+
+int outbuf_flush(outbuf *o)
+{
+    struct iovec *iov = o->iov;
+    int cnt = 0;
+
+    outbuf_end_run(o);
+    cnt = o->iovcnt;
+
+    for (; o->sink != NULL && cnt > 0 && !o->error; iov++, cnt--) {
+        if (o->sink(o->sink_data, iov->iov_base, iov->iov_len) != 0) o->error = 1;
+    }
+
+    while (cnt > 0 && !o->error) {
+        ssize_t n = writev(o->fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            o->error = 1;
+            break;
+        }
+        // Skip what was written, resuming partial writes mid-piece:
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    o->iovcnt = 0;
+    o->len = o->run = 0;
+
+    return o->error ? -1 : 0;
+}
+
+int outbuf_write(outbuf *o, const void *s, size_t n)
+{
+    if (n > o->size - o->len) {
+        if (outbuf_flush(o) != 0) return -1;
+        if (n > o->size) {
+            // Too big to stage; it's written before s can change anyway:
+            o->iov[0].iov_base = (void *)s;
+            o->iov[0].iov_len = n;
+            o->iovcnt = 1;
+            return outbuf_flush(o);
+        }
+    }
+
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+    return 0;
+}
+
+int outbuf_ref(outbuf *o, const void *s, size_t n)
+{
+    if (n < OUTBUF_MIN_REF) return outbuf_write(o, s, n);
+
+    // Room for the staged run, s, and the run that flushing will end:
+    if (o->iovcnt + 3 > o->iovmax && outbuf_flush(o) != 0) return -1;
+
+    outbuf_end_run(o);
+    o->iov[o->iovcnt].iov_base = (void *)s;
+    o->iov[o->iovcnt].iov_len = n;
+    o->iovcnt++;
+    return 0;
+}
+
+int outbuf_putu(outbuf *o, unsigned long long u)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+
+    do {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+
+    return outbuf_write(o, p, digits + sizeof(digits) - p);
+}
@@ -0,0 +1,53 @@
+#ifndef __outbuf_h__
+#define __outbuf_h__
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define OUTBUF_SIZE (1 << 20)   // Default staging buffer size
+#define OUTBUF_MIN_REF 512      // Shorter spans are copied instead of referenced
+
+// Output batched into writev() calls.  Small pieces (prefixes, numbers,
+// short records) are copied into a staging buffer; longer spans that outlive
+// the next flush (e.g. records in a mapped file) are only referenced.
+// Output can also be handed to a sink function instead of a descriptor.
+typedef struct outbuf {
+    int fd;                 // Destination file descriptor
+    int (*sink)(void *data, const void *s, size_t n);  // Destination instead, if set
+    void *sink_data;
+    char *buf;              // Staging buffer
+    size_t len;             // Bytes used in buf
+    size_t size;            // Allocated size for buf
+    size_t run;             // Start of the staged bytes not yet in iov
+    struct iovec *iov;      // Pending pieces, in output order
+    int iovcnt;
+    int iovmax;
+    int error;              // Set once a write fails
+} outbuf;
+
+int outbuf_init(outbuf *o, int fd, size_t size);
+
+// Send what is flushed to sink(data, ...), which returns 0 on success.
+void outbuf_set_sink(outbuf *o, int (*sink)(void *data, const void *s, size_t n), void *data);
+void outbuf_free(outbuf *o);
+
+// Write everything pending.  Returns 0 on success, -1 if any write failed.
+int outbuf_flush(outbuf *o);
+
+// Copy n bytes from s.
+int outbuf_write(outbuf *o, const void *s, size_t n);
+
+// Output n bytes at s, which must stay unchanged until the next flush.
+int outbuf_ref(outbuf *o, const void *s, size_t n);
+
+// Copy a decimal number.
+int outbuf_putu(outbuf *o, unsigned long long u);
+
+static inline int outbuf_putc(outbuf *o, char c)
+{
+    if (o->len == o->size && outbuf_flush(o) != 0) return -1;
+    o->buf[o->len++] = c;
+    return 0;
+}
+
+#endif
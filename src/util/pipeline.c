@@ -0,0 +1,412 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util/dbg.h"
+#include "util/pipeline.h"
+
+#define PIPELINE_ALIGN 64   // Blocks start on a cache line, for vector loads
+
+static char *pipeline_block_alloc(size_t size)
+{
+    void *data = NULL;
+    return (posix_memalign(&data, PIPELINE_ALIGN, size) == 0) ? data : NULL;
+}
+
+// Free the blocks of a stage and its rings:
+static void pipeline_free(pipeline_block *blocks, ring *full, ring *empty)
+{
+    for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+        free(blocks[i].data);
+        blocks[i].data = NULL;
+    }
+    ring_free(full);
+    ring_free(empty);
+}
+
+// Allocate the blocks of a stage and queue them all as empty:
+static int pipeline_alloc(pipeline_block *blocks, size_t size, ring *full, ring *empty)
+{
+    int rc = ring_init(full, PIPELINE_BLOCKS);
+    rc |= ring_init(empty, PIPELINE_BLOCKS);
+
+    for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+        blocks[i].data = pipeline_block_alloc(size);
+        blocks[i].len = 0;
+        if (blocks[i].data == NULL) rc = -1;
+    }
+    check_mem(rc == 0);
+
+    for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+        ring_push(empty, &blocks[i]);
+    }
+    return 0;
+
+error:
+    pipeline_free(blocks, full, empty);
+    return -1;
+}
+
+static void *readahead_thread(void *arg)
+{
+    readahead *ra = arg;
+    int state;
+
+    // Only a read may be cancelled, so the rings are never left locked:
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+    while (1) {
+        pipeline_block *b = ring_pop(&ra->empty);
+        if (__atomic_load_n(&ra->stop, __ATOMIC_ACQUIRE)) break;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+        b->len = fread(b->data + ra->room, 1, ra->size, ra->fp);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+        if (b->len == 0 && ferror(ra->fp)) {
+            // Seen by the consumer once it pops b:
+            ra->error = errno ? errno : EIO;
+        }
+
+        ring_push(&ra->full, b);
+        if (b->len == 0) break;
+    }
+
+    return NULL;
+}
+
+// Bytes asked for by one io_uring read (its length is 32 bits):
+#define READAHEAD_MAX_READ (1u << 30)
+
+// Queue a read of the rest of block b (io_uring):
+static int readahead_queue(readahead *ra, pipeline_block *b)
+{
+    size_t len = ra->size - b->len;
+
+    if (len > READAHEAD_MAX_READ) len = READAHEAD_MAX_READ;
+    b->busy = 1;
+    return uring_read(&ra->u, fileno(ra->fp), b->data + ra->room + b->len, (unsigned)len,
+                      b->offset + b->len, (uint64_t)(b - ra->blocks));
+}
+
+// Reading block b failed with err after what it has so far, so the input
+// is cut short there; the consumer gets ra->error when it gets that far:
+static void readahead_fail(readahead *ra, pipeline_block *b, int err)
+{
+    if (b->offset + b->len < ra->failed_at) {
+        ra->failed_at = b->offset + b->len;
+        ra->error = err;
+    }
+}
+
+// Read the rest of block b without io_uring, if it can't be queued:
+static void readahead_pread(readahead *ra, pipeline_block *b)
+{
+    while (b->len < ra->size) {
+        ssize_t n = pread(fileno(ra->fp), b->data + ra->room + b->len, ra->size - b->len,
+                          (off_t)(b->offset + b->len));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) readahead_fail(ra, b, errno);
+        if (n <= 0) break;
+        b->len += (size_t)n;
+    }
+    b->busy = 0;
+}
+
+// Queue the next read into block b, or do it right away if that fails:
+static void readahead_requeue(readahead *ra, pipeline_block *b)
+{
+    if (readahead_queue(ra, b) != 0 || uring_submit(&ra->u) != 0) {
+        readahead_pread(ra, b);
+    }
+}
+
+// Wait for a read to complete, queueing the rest of it if it came up short:
+static int readahead_reap(readahead *ra)
+{
+    uint64_t tag = 0;
+    int res = 0;
+
+    if (uring_wait(&ra->u, &tag, &res) != 0) return -1;
+
+    pipeline_block *b = &ra->blocks[tag];
+    if (res == -EINTR || res == -EAGAIN) {
+        res = 0;
+    }
+    else if (res < 0) {
+        readahead_fail(ra, b, -res);
+        b->busy = 0;
+        return 0;
+    }
+    else if (res == 0) {
+        b->busy = 0;
+        return 0;
+    }
+
+    b->len += (size_t)res;
+    b->busy = 0;
+    if (b->len < ra->size && !ra->stop) readahead_requeue(ra, b);
+    return 0;
+}
+
+// Read fp with io_uring, all the blocks at once to begin with:
+static int readahead_start_uring(readahead *ra)
+{
+    int fd = fileno(ra->fp);
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    if (uring_init(&ra->u, PIPELINE_BLOCKS) != 0) return -1;
+
+    // Starting where fp is, in case part of it was read already:
+    off_t at = lseek(fd, 0, SEEK_CUR);
+    ra->offset = (at > 0) ? (uint64_t)at : 0;
+    ra->failed_at = UINT64_MAX;
+    ra->next = 0;
+
+    for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+        pipeline_block *b = &ra->blocks[i];
+        b->data = pipeline_block_alloc(ra->room + ra->size);
+        check_mem(b->data);
+        b->len = 0;
+        b->offset = ra->offset;
+        ra->offset += ra->size;
+        check(readahead_queue(ra, b) == 0, "Error queueing a read.");
+    }
+    check(uring_submit(&ra->u) == 0, "Error submitting reads.");
+
+    ra->how = READAHEAD_URING;
+    return 0;
+
+error:
+    // Nothing was submitted; what was queued goes with the ring:
+    for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+        free(ra->blocks[i].data);
+        ra->blocks[i].data = NULL;
+    }
+    uring_free(&ra->u);
+    return -1;
+}
+
+int readahead_start(readahead *ra, FILE *fp, size_t size, size_t room, int how)
+{
+    ra->fp = fp;
+    ra->size = size;
+    ra->room = room;
+    ra->cur = NULL;
+    ra->eof = 0;
+    ra->stop = 0;
+    ra->error = 0;
+    ra->how = 0;
+    for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+        ra->blocks[i].data = NULL;
+        ra->blocks[i].busy = 0;
+    }
+
+    if ((how & READAHEAD_URING) && readahead_start_uring(ra) == 0) return 0;
+
+    if (!(how & READAHEAD_THREAD)) {
+        ra->cur = &ra->blocks[0];
+        ra->cur->data = pipeline_block_alloc(room + size);
+        check_mem(ra->cur->data);
+        return 0;
+    }
+
+    check_debug(pipeline_alloc(ra->blocks, room + size, &ra->full, &ra->empty) == 0,
+                "Error allocating read-ahead blocks.");
+    if (pthread_create(&ra->thread, NULL, readahead_thread, ra) != 0) {
+        pipeline_free(ra->blocks, &ra->full, &ra->empty);
+        sentinel("Error starting a thread.");
+    }
+    ra->how = READAHEAD_THREAD;
+
+    return 0;
+
+error:
+    return -1;
+}
+
+size_t readahead_next(readahead *ra, const char *keep, size_t nkeep, char **data)
+{
+    pipeline_block *last = ra->cur;
+
+    if (ra->eof) {
+        *data = (char *)keep;
+        return 0;
+    }
+
+    if (ra->how == 0) {
+        // keep may be in the block itself:
+        *data = last->data + ra->room - nkeep;
+        if (nkeep > 0) memmove(*data, keep, nkeep);
+        last->len = fread(last->data + ra->room, 1, ra->size, ra->fp);
+        ra->eof = (last->len == 0);
+        if (ra->eof && ferror(ra->fp)) ra->error = errno ? errno : EIO;
+        return last->len;
+    }
+
+    if (ra->how == READAHEAD_URING) {
+        ra->cur = &ra->blocks[ra->next];
+        ra->next = (ra->next + 1) % PIPELINE_BLOCKS;
+        while (ra->cur->busy) {
+            if (readahead_reap(ra) != 0) {
+                ra->failed_at = 0;
+                ra->error = errno ? errno : EIO;
+                break;
+            }
+        }
+        if (ra->cur->offset >= ra->failed_at) ra->cur->len = 0;
+    }
+    else {
+        ra->cur = ring_pop(&ra->full);
+    }
+
+    ra->eof = (ra->cur->len == 0);
+    *data = ra->cur->data + ra->room - nkeep;
+    if (nkeep > 0) memcpy(*data, keep, nkeep);
+
+    // Only now can the last block be reused:
+    if (last == NULL) {
+        // Nothing to hand back yet
+    }
+    else if (ra->how == READAHEAD_URING) {
+        // For the block after the last one queued:
+        last->len = 0;
+        last->offset = ra->offset;
+        ra->offset += ra->size;
+        readahead_requeue(ra, last);
+    }
+    else {
+        ring_push(&ra->empty, last);
+    }
+    return ra->cur->len;
+}
+
+void readahead_stop(readahead *ra)
+{
+    pipeline_block *b = NULL;
+
+    if (ra->how == 0) {
+        free(ra->cur->data);
+        ra->cur->data = NULL;
+        return;
+    }
+
+    __atomic_store_n(&ra->stop, 1, __ATOMIC_RELEASE);
+
+    if (ra->how == READAHEAD_URING) {
+        // The kernel may still be reading into the blocks:
+        for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+            while (ra->blocks[i].busy) {
+                if (readahead_reap(ra) != 0) return;  // Better leaked than reused
+            }
+        }
+        for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+            free(ra->blocks[i].data);
+            ra->blocks[i].data = NULL;
+        }
+        uring_free(&ra->u);
+        ra->cur = NULL;
+        return;
+    }
+
+    pthread_cancel(ra->thread);
+
+    // Hand back every block, so the thread isn't left waiting for one:
+    if (ra->cur != NULL) ring_push(&ra->empty, ra->cur);
+    while ((b = ring_try_pop(&ra->full)) != NULL) {
+        ring_push(&ra->empty, b);
+    }
+
+    pthread_join(ra->thread, NULL);
+    pipeline_free(ra->blocks, &ra->full, &ra->empty);
+    ra->cur = NULL;
+}
+
+static void *writebehind_thread(void *arg)
+{
+    writebehind *wb = arg;
+    pipeline_block *b = NULL;
+
+    while ((b = ring_pop(&wb->full))->len > 0) {
+        // Flushed before the block can be filled again:
+        outbuf_ref(wb->to, b->data, b->len);
+        outbuf_flush(wb->to);
+        ring_push(&wb->empty, b);
+    }
+
+    return NULL;
+}
+
+// Copy what wb->out flushes into blocks, queueing each once it's full:
+static int writebehind_sink(void *data, const void *s, size_t n)
+{
+    writebehind *wb = data;
+
+    while (n > 0) {
+        if (wb->cur == NULL) {
+            wb->cur = ring_pop(&wb->empty);
+            wb->cur->len = 0;
+        }
+
+        size_t k = wb->out.size - wb->cur->len;
+        if (k > n) k = n;
+        memcpy(wb->cur->data + wb->cur->len, s, k);
+        wb->cur->len += k;
+        s = (const char *)s + k;
+        n -= k;
+
+        if (wb->cur->len == wb->out.size) {
+            ring_push(&wb->full, wb->cur);
+            wb->cur = NULL;
+        }
+    }
+
+    return 0;
+}
+
+int writebehind_start(writebehind *wb, outbuf *to)
+{
+    wb->to = to;
+    wb->cur = NULL;
+
+    check_debug(outbuf_init(&wb->out, to->fd, 0) == 0, "Error allocating output.");
+    outbuf_set_sink(&wb->out, writebehind_sink, wb);
+
+    if (pipeline_alloc(wb->blocks, wb->out.size, &wb->full, &wb->empty) != 0) {
+        outbuf_free(&wb->out);
+        sentinel("Error allocating write-behind blocks.");
+    }
+    if (pthread_create(&wb->thread, NULL, writebehind_thread, wb) != 0) {
+        pipeline_free(wb->blocks, &wb->full, &wb->empty);
+        outbuf_free(&wb->out);
+        sentinel("Error starting a thread.");
+    }
+
+    return 0;
+
+error:
+    return -1;
+}
+
+int writebehind_finish(writebehind *wb)
+{
+    int rc = outbuf_flush(&wb->out);
+
+    if (wb->cur != NULL && wb->cur->len > 0) {
+        ring_push(&wb->full, wb->cur);
+        wb->cur = NULL;
+    }
+
+    // An empty block tells the thread it's done:
+    if (wb->cur == NULL) wb->cur = ring_pop(&wb->empty);
+    wb->cur->len = 0;
+    ring_push(&wb->full, wb->cur);
+    wb->cur = NULL;
+
+    pthread_join(wb->thread, NULL);
+    pipeline_free(wb->blocks, &wb->full, &wb->empty);
+    outbuf_free(&wb->out);
+
+    return (rc != 0 || wb->to->error) ? -1 : 0;
+}
@@ -0,0 +1,84 @@
+#ifndef __pipeline_h__
+#define __pipeline_h__
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "util/ring.h"
+#include "util/outbuf.h"
+#include "util/uring.h"
+
+#define PIPELINE_BLOCKS 4   // Blocks in flight between two stages
+
+#define READAHEAD_THREAD 1  // Read with a thread of its own
+#define READAHEAD_URING 2   // Read a regular file with io_uring if possible
+
+// A block of bytes handed from one stage to the next:
+typedef struct pipeline_block {
+    char *data;
+    size_t len;             // Bytes in data; 0 marks the end
+    uint64_t offset;        // With io_uring: where in the file data goes
+    int busy;               // With io_uring: still being read into
+} pipeline_block;
+
+// Streamed input read a block at a time by a thread of its own, so reading
+// the next block overlaps with scanning the last one.  Blocks go to the
+// consumer through one ring and come back empty through another.  With
+// io_uring, the kernel reads every block not in use at once, so a fast
+// device sees several requests at a time.  Otherwise, one block is read
+// into when the consumer asks for the next.
+typedef struct readahead {
+    FILE *fp;
+    size_t size;            // Bytes read into a block
+    size_t room;            // Bytes left free before them
+    pipeline_block blocks[PIPELINE_BLOCKS];
+    ring full;              // Blocks read, for the consumer
+    ring empty;             // Blocks to read into, for the thread
+    pipeline_block *cur;    // The block the consumer has
+    int eof;                // The consumer has seen the end
+    int stop;               // Set to make the thread give up
+    int error;              // errno of the read that ended the input, or 0
+    int how;                // READAHEAD_THREAD, READAHEAD_URING or 0
+    pthread_t thread;
+    uring u;                // With io_uring: the ring,
+    uint64_t offset;        // where the next block to queue goes,
+    uint64_t failed_at;     // where a read failed (the input ends there),
+    size_t next;            // and the block to hand out next
+} readahead;
+
+// Start reading fp in blocks of size bytes, as how asks (READAHEAD_URING,
+// READAHEAD_THREAD, both to fall back on a thread, or 0).  Returns 0 on
+// success, -1 on error.
+int readahead_start(readahead *ra, FILE *fp, size_t size, size_t room, int how);
+
+// Hand back the last block and point *data at the next, after a copy of
+// the nkeep (at most ra->room) bytes at keep, e.g. what the last block left
+// unfinished.  Returns the bytes read, or 0 at EOF; ra->error is set then if
+// the input ended because a read failed.
+size_t readahead_next(readahead *ra, const char *keep, size_t nkeep, char **data);
+
+// Stop the thread (if any), even if it's still waiting for input, and free
+// the blocks.  fp is left open.
+void readahead_stop(readahead *ra);
+
+// Output written by a thread of its own, so a slow destination (a pipe, a
+// terminal) doesn't hold up the thread producing it.  That thread writes to
+// wb->out, whose flushes are copied into blocks for the writer thread.
+typedef struct writebehind {
+    outbuf out;             // Where the producer writes
+    outbuf *to;             // Where the writer thread writes it to
+    pipeline_block blocks[PIPELINE_BLOCKS];
+    ring full;              // Blocks to write, for the thread
+    ring empty;             // Blocks written, for the producer
+    pipeline_block *cur;    // The block being filled
+    pthread_t thread;
+} writebehind;
+
+// Start writing to the outbuf to.  Returns 0 on success, -1 on error.
+int writebehind_start(writebehind *wb, outbuf *to);
+
+// Flush wb->out and wait until all of it is written to wb->to, then stop
+// the thread.  Returns 0 on success, -1 if anything couldn't be written.
+int writebehind_finish(writebehind *wb);
+
+#endif
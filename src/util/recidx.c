@@ -0,0 +1,117 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "util/recidx.h"
+
+#define RECIDX_MAGIC 0x5849544e554f434eull  // "NCOUNTIX", which also tells the byte order
+#define RECIDX_HEAD 10                      // uint64_t values before the checkpoints
+
+void recidx_init(recidx *ix, uint64_t step)
+{
+    ix->step = step;
+    ix->size = ix->mtime_sec = ix->mtime_nsec = 0;
+    ix->layout = ix->check = 0;
+    ix->records = ix->mismatches = 0;
+    ix->marks = NULL;
+    ix->nmarks = ix->size_marks = 0;
+    ix->error = 0;
+}
+
+void recidx_free(recidx *ix)
+{
+    free(ix->marks);
+    recidx_init(ix, ix->step);
+}
+
+int recidx_stamp(recidx *ix, const char *filename)
+{
+    struct stat st;
+
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    ix->size = (uint64_t)st.st_size;
+    ix->mtime_sec = (uint64_t)st.st_mtim.tv_sec;
+    ix->mtime_nsec = (uint64_t)st.st_mtim.tv_nsec;
+    return 0;
+}
+
+int recidx_fresh(const recidx *ix, const char *filename)
+{
+    recidx now;
+
+    recidx_init(&now, ix->step);
+    return recidx_stamp(&now, filename) == 0 && now.size == ix->size
+        && now.mtime_sec == ix->mtime_sec && now.mtime_nsec == ix->mtime_nsec;
+}
+
+void recidx_add(recidx *ix, uint64_t rnum, uint64_t offset, uint64_t mismatches)
+{
+    if (ix->nmarks == ix->size_marks) {
+        size_t size = ix->size_marks ? ix->size_marks * 2 : 1024;
+        recidx_mark *grown = realloc(ix->marks, size * sizeof(recidx_mark));
+        if (grown == NULL) {
+            ix->error = 1;
+            return;
+        }
+        ix->marks = grown;
+        ix->size_marks = size;
+    }
+
+    recidx_mark *m = &ix->marks[ix->nmarks++];
+    m->rnum = rnum;
+    m->offset = offset;
+    m->mismatches = mismatches;
+}
+
+int recidx_save(const recidx *ix, const char *path)
+{
+    uint64_t head[RECIDX_HEAD] = {
+        RECIDX_MAGIC, ix->step, ix->size, ix->mtime_sec, ix->mtime_nsec,
+        ix->layout, ix->check, ix->records, ix->mismatches, ix->nmarks
+    };
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+
+    int rc = (fwrite(head, sizeof(head), 1, fp) == 1
+              && fwrite(ix->marks, sizeof(recidx_mark), ix->nmarks, fp) == ix->nmarks) ? 0 : -1;
+    if (fclose(fp) != 0) rc = -1;
+    return rc;
+}
+
+int recidx_load(recidx *ix, const char *path)
+{
+    uint64_t head[RECIDX_HEAD];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return -1;
+
+    recidx_init(ix, 1);
+    if (fread(head, sizeof(head), 1, fp) != 1) goto error;
+    if (head[0] != RECIDX_MAGIC || head[1] == 0 || head[9] > SIZE_MAX / sizeof(recidx_mark)) goto error;
+
+    ix->step = head[1];
+    ix->size = head[2];
+    ix->mtime_sec = head[3];
+    ix->mtime_nsec = head[4];
+    ix->layout = head[5];
+    ix->check = head[6];
+    ix->records = head[7];
+    ix->mismatches = head[8];
+    ix->nmarks = ix->size_marks = (size_t)head[9];
+
+    ix->marks = malloc(ix->nmarks * sizeof(recidx_mark) + 1);
+    if (ix->marks == NULL) goto error;
+    if (fread(ix->marks, sizeof(recidx_mark), ix->nmarks, fp) != ix->nmarks) goto error;
+
+    // recidx_find() relies on the spacing:
+    for (size_t i = 0; i < ix->nmarks; i++) {
+        if (ix->marks[i].rnum != i * ix->step || ix->marks[i].offset > ix->size) goto error;
+    }
+
+    fclose(fp);
+    return 0;
+
+error:
+    fclose(fp);
+    recidx_free(ix);
+    return -1;
+}
@@ -0,0 +1,60 @@
+#ifndef __recidx_h__
+#define __recidx_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A sidecar index of a file's records: a checkpoint every step records with
+// where the next record starts and how many mismatched before it.  Record
+// rnum (1-based) is then found by scanning from checkpoint (rnum - 1) / step,
+// a chunk can start at any checkpoint knowing its first record number, and
+// the mismatches between two checkpoints are the difference of theirs.
+typedef struct recidx_mark {
+    uint64_t rnum;          // Records before offset
+    uint64_t offset;        // Where record rnum + 1 starts
+    uint64_t mismatches;    // Mismatching records before offset
+} recidx_mark;
+
+typedef struct recidx {
+    uint64_t step;          // Records between checkpoints
+    uint64_t size;          // Size and modification time of the indexed file
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t layout;        // What its record boundaries depend on (e.g. CSV dialect)
+    uint64_t check;         // What its mismatches depend on as well (e.g. field count)
+    uint64_t records;       // Records and mismatches in the whole file
+    uint64_t mismatches;
+    recidx_mark *marks;     // Checkpoint i is at record i * step
+    size_t nmarks;
+    size_t size_marks;      // Allocated size for marks
+    int error;              // Set once out of memory; checkpoints are missing
+} recidx;
+
+void recidx_init(recidx *ix, uint64_t step);
+void recidx_free(recidx *ix);
+
+// Record the size and modification time of filename.  Returns 0 on success,
+// -1 if it can't be read or isn't a regular file.
+int recidx_stamp(recidx *ix, const char *filename);
+
+// Whether filename is still the file stamped (same size and time).
+int recidx_fresh(const recidx *ix, const char *filename);
+
+// Add the next checkpoint; rnum must be nmarks * step.
+void recidx_add(recidx *ix, uint64_t rnum, uint64_t offset, uint64_t mismatches);
+
+// The last checkpoint before record rnum (1-based), or NULL if there's none.
+static inline const recidx_mark *recidx_find(const recidx *ix, uint64_t rnum)
+{
+    uint64_t i = (rnum > 0) ? (rnum - 1) / ix->step : 0;
+
+    if (ix->nmarks == 0) return NULL;
+    return &ix->marks[i < ix->nmarks ? i : ix->nmarks - 1];
+}
+
+// Write ix to path, or read it back.  Both return 0 on success, -1 on error
+// (including, when loading, a file that isn't a valid index).
+int recidx_save(const recidx *ix, const char *path);
+int recidx_load(recidx *ix, const char *path);
+
+#endif
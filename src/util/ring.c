@@ -0,0 +1,131 @@
+#include <sched.h>
+#include <stdlib.h>
+#include "util/ring.h"
+
+#define RING_SPIN 64        // Times to yield before sleeping on a full or empty ring
+
+int ring_init(ring *r, size_t size)
+{
+    size_t n = 1;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    r->head = r->tail = 0;
+    r->push_waiting = r->pop_waiting = 0;
+
+    while (n < size) n *= 2;
+    r->mask = n - 1;
+    r->slots = calloc(n, sizeof(void *));
+    return r->slots ? 0 : -1;
+}
+
+void ring_free(ring *r)
+{
+    free(r->slots);
+    r->slots = NULL;
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_full);
+    pthread_cond_destroy(&r->not_empty);
+}
+
+// Each end is only moved by its own side, which publishes the slot with it:
+static int ring_put(ring *r, void *p)
+{
+    size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask) return -1;
+    r->slots[tail & r->mask] = p;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void *ring_take(ring *r)
+{
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return NULL;
+    void *p = r->slots[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/*
+   Wake the other side if it's asleep.  The fence orders the move of our end
+   before the look at its flag, as ring_sleep() orders setting the flag before
+   looking at our end again, so one of the two always sees the other.
+*/
+static void ring_wake(ring *r, int *waiting, pthread_cond_t *cond)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// Sleep (under r->lock) until woken, or until the other side has moved:
+static void ring_sleep(ring *r, int *waiting, pthread_cond_t *cond, size_t *end, size_t seen)
+{
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(end, __ATOMIC_RELAXED) == seen) {
+        pthread_cond_wait(cond, &r->lock);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+int ring_try_push(ring *r, void *p)
+{
+    if (ring_put(r, p) != 0) return -1;
+    ring_wake(r, &r->pop_waiting, &r->not_empty);
+    return 0;
+}
+
+void *ring_try_pop(ring *r)
+{
+    void *p = ring_take(r);
+    if (p != NULL) ring_wake(r, &r->push_waiting, &r->not_full);
+    return p;
+}
+
+void ring_push(ring *r, void *p)
+{
+    // The consumer is usually about to make room; yielding to it is cheaper
+    // than sleeping until it does:
+    for (int i = 0; ring_put(r, p) != 0; i++) {
+        if (i < RING_SPIN) {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&r->lock);
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        if (r->tail - head > r->mask) {
+            ring_sleep(r, &r->push_waiting, &r->not_full, &r->head, head);
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    ring_wake(r, &r->pop_waiting, &r->not_empty);
+}
+
+void *ring_pop(ring *r)
+{
+    void *p = NULL;
+
+    // Likewise for the producer:
+    for (int i = 0; (p = ring_take(r)) == NULL; i++) {
+        if (i < RING_SPIN) {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&r->lock);
+        size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        if (tail == r->head) {
+            ring_sleep(r, &r->pop_waiting, &r->not_empty, &r->tail, tail);
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    ring_wake(r, &r->push_waiting, &r->not_full);
+    return p;
+}
@@ -0,0 +1,38 @@
+#ifndef __ring_h__
+#define __ring_h__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define RING_ALIGN 64       // Keeps the two ends on cache lines of their own
+
+// A bounded queue of pointers between one producer thread and one consumer
+// thread.  Pushing and popping are lock-free; the mutex is only taken to
+// sleep while the ring is full or empty, and to wake the other side up.
+typedef struct ring {
+    void **slots;           // size slots, a power of two
+    size_t mask;            // size - 1
+    size_t head __attribute__((aligned(RING_ALIGN)));  // Next slot to pop
+    size_t tail __attribute__((aligned(RING_ALIGN)));  // Next slot to push
+    int push_waiting __attribute__((aligned(RING_ALIGN)));  // The producer is asleep
+    int pop_waiting;                                        // The consumer is asleep
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+} ring;
+
+// Make room for at least size pointers.  Returns 0 on success, -1 if out of
+// memory; ring_free() must be called either way.
+int ring_init(ring *r, size_t size);
+void ring_free(ring *r);
+
+// Push p (not NULL), or pop the oldest pointer, without blocking.  Pushing
+// returns 0, or -1 if the ring is full; popping returns NULL if it's empty.
+int ring_try_push(ring *r, void *p);
+void *ring_try_pop(ring *r);
+
+// The same, waiting for room or for a pointer to pop.
+void ring_push(ring *r, void *p);
+void *ring_pop(ring *r);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdint.h>
+#include <string.h>
+#include "util/scan.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef void (*scan_record_fn)(const char *, const char *, const char *, size_t, scan_rec *);
+
+// Does a complete delimiter start at c?
+static inline int scan_match(const char *c, const char *end, const char *delim, size_t dlen)
+{
+    return (size_t)(end - c) >= dlen && memcmp(c + 1, delim + 1, dlen - 1) == 0;
+}
+
+/*
+   Finish scanning a record byte by byte from p.  start is where the record
+   began; dc and nul carry what was found before p, and no delimiter may
+   begin before skip (the end of the last match).
+*/
+static inline void scan_tail(const char *start, const char *p, const char *end,
+        const char *delim, size_t dlen, const char *skip, size_t dc, int nul,
+        scan_rec *rec)
+{
+    const unsigned char d0 = (unsigned char)delim[0];
+
+    while (p < end) {
+        const char *c = p++;
+        if ((unsigned char)*c == d0 && c >= skip && scan_match(c, end, delim, dlen)) {
+            dc++;
+            skip = c + dlen;
+        }
+        nul |= (*c == 0);
+        if (*c == '\n') break;
+    }
+
+    if (p > start && p[-1] == '\n') {
+        rec->open = 0;
+    }
+    else {
+        // A delimiter cut off by end begins in its last dlen - 1 bytes, and
+        // after the last match:
+        const char *from = ((size_t)(end - start) > dlen - 1) ? end - (dlen - 1) : start;
+        if (from < skip) from = skip;
+        rec->open = end - from;
+    }
+
+    rec->len = p - start;
+    rec->delims = dc;
+    rec->has_nul = nul;
+}
+
+static void scan_record_scalar(const char *p, const char *end, const char *delim, size_t dlen, scan_rec *rec)
+{
+    scan_tail(p, p, end, delim, dlen, p, 0, 0, rec);
+}
+
+#ifdef SCAN_X86
+
+/*
+   Each kernel compares W bytes at a time against the delimiter's first
+   byte, the newline and NUL.  The three bitmasks are cut off after the first
+   newline; single-byte delimiters are then popcounted, while longer ones
+   verify each candidate.  The remainder shorter than a vector is finished
+   by scan_tail().
+*/
+#define SCAN_RECORD_KERNEL(W, MASKS)                                            \
+    const char *start = p;                                                      \
+    const char *skip = p;                                                       \
+    const unsigned char d0 = (unsigned char)delim[0];                           \
+    size_t dc = 0;                                                              \
+    uint64_t nul = 0;                                                           \
+                                                                                \
+    while (end - p >= W) {                                                      \
+        uint64_t dm, nm, zm;                                                    \
+        MASKS(p, d0, &dm, &nm, &zm);                                            \
+        if (nm) {                                                               \
+            uint64_t live = (2ull << __builtin_ctzll(nm)) - 1;                  \
+            dm &= live;                                                         \
+            zm &= live;                                                         \
+        }                                                                       \
+        nul |= zm;                                                              \
+        if (dlen == 1) {                                                        \
+            dc += __builtin_popcountll(dm);                                     \
+        }                                                                       \
+        else {                                                                  \
+            for (; dm; dm &= dm - 1) {                                          \
+                const char *c = p + __builtin_ctzll(dm);                        \
+                if (c >= skip && scan_match(c, end, delim, dlen)) {             \
+                    dc++;                                                       \
+                    skip = c + dlen;                                            \
+                }                                                               \
+            }                                                                   \
+        }                                                                       \
+        if (nm) {                                                               \
+            rec->len = p + __builtin_ctzll(nm) + 1 - start;                     \
+            rec->delims = dc;                                                   \
+            rec->has_nul = (nul != 0);                                          \
+            rec->open = 0;                                                      \
+            return;                                                             \
+        }                                                                       \
+        p += W;                                                                 \
+    }                                                                           \
+                                                                                \
+    scan_tail(start, p, end, delim, dlen, skip, dc, nul != 0, rec)
+
+__attribute__((target("sse2")))
+static inline void scan_masks_sse2(const char *p, unsigned char d, uint64_t *dm, uint64_t *nm, uint64_t *zm)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    *dm = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)d)));
+    *nm = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    *zm = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
+
+__attribute__((target("avx2")))
+static inline void scan_masks_avx2(const char *p, unsigned char d, uint64_t *dm, uint64_t *nm, uint64_t *zm)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    *dm = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)d)));
+    *nm = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    *zm = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void scan_masks_avx512(const char *p, unsigned char d, uint64_t *dm, uint64_t *nm, uint64_t *zm)
+{
+    __m512i v = _mm512_loadu_si512((const void *)p);
+    *dm = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8((char)d));
+    *nm = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n'));
+    *zm = _mm512_testn_epi8_mask(v, v);
+}
+
+__attribute__((target("sse2")))
+static void scan_record_sse2(const char *p, const char *end, const char *delim, size_t dlen, scan_rec *rec)
+{
+    SCAN_RECORD_KERNEL(16, scan_masks_sse2);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static void scan_record_avx2(const char *p, const char *end, const char *delim, size_t dlen, scan_rec *rec)
+{
+    SCAN_RECORD_KERNEL(32, scan_masks_avx2);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt,bmi")))
+static void scan_record_avx512(const char *p, const char *end, const char *delim, size_t dlen, scan_rec *rec)
+{
+    SCAN_RECORD_KERNEL(64, scan_masks_avx512);
+}
+
+#endif
+
+static scan_record_fn scan_record_impl = scan_record_scalar;
+
+void scan_init(void)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt")) {
+        scan_record_impl = scan_record_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        scan_record_impl = scan_record_avx2;
+    }
+    else {
+        scan_record_impl = scan_record_sse2;
+    }
+#endif
+}
+
+// The byte at c, with a NUL read as nul_as:
+static inline char scan_byte(const char *c, char nul_as)
+{
+    return (*c == 0) ? nul_as : *c;
+}
+
+void scan_record_nul_as(const char *p, const char *end, const char *delim, size_t dlen,
+                        char nul_as, scan_rec *rec)
+{
+    const char *start = p;
+    const char *skip = p;
+    size_t dc = 0;
+    int nul = 0;
+
+    if (dlen > 1 && memchr(delim, '\n', dlen - 1) != NULL) {
+        scan_record(p, end, delim, dlen, rec);
+        return;
+    }
+
+    // Rare enough (a delimiter with nul_as in it, and NULs) to go a byte at a time:
+    while (p < end) {
+        const char *c = p++;
+        if (c >= skip && (size_t)(end - c) >= dlen) {
+            size_t i = 0;
+            while (i < dlen && scan_byte(c + i, nul_as) == delim[i]) i++;
+            if (i == dlen) {
+                dc++;
+                skip = c + dlen;
+            }
+        }
+        nul |= (*c == 0);
+        if (*c == '\n') break;
+    }
+
+    if (p > start && p[-1] == '\n') {
+        rec->open = 0;
+    }
+    else {
+        const char *from = ((size_t)(end - start) > dlen - 1) ? end - (dlen - 1) : start;
+        if (from < skip) from = skip;
+        rec->open = end - from;
+    }
+
+    rec->len = p - start;
+    rec->delims = dc;
+    rec->has_nul = nul;
+}
+
+void scan_record(const char *p, const char *end, const char *delim, size_t dlen, scan_rec *rec)
+{
+    // A delimiter with a newline before its last byte can never fit in a record:
+    if (dlen > 1 && memchr(delim, '\n', dlen - 1) != NULL) {
+        scan_record_impl(p, end, "\n", 1, rec);
+        rec->delims = 0;
+        return;
+    }
+
+    scan_record_impl(p, end, delim, dlen, rec);
+}
@@ -0,0 +1,29 @@
+#ifndef __scan_h__
+#define __scan_h__
+
+#include <stddef.h>
+
+// What a single pass over one record of a delimited file tells us:
+typedef struct scan_rec {
+    size_t len;       // Bytes in the record, newline included
+    size_t delims;    // Non-overlapping delimiter matches in the record
+    int has_nul;      // Whether the record contains NUL bytes
+    size_t open;      // Without a newline: bytes at the end that may begin a
+                      // delimiter cut off by end (scan them again with more)
+} scan_rec;
+
+// Pick the widest scanning kernel the CPU supports.  Call once, before any
+// other scan_* function.
+void scan_init(void);
+
+// Scan the record starting at p (and ending after the first newline, or at
+// end), counting occurrences of the dlen-byte delimiter and looking for NUL
+// bytes on the way.
+void scan_record(const char *p, const char *end, const char *delim, size_t dlen, scan_rec *rec);
+
+// Likewise, but with each NUL byte counted as if it were nul_as (what it's
+// output as), without changing the record.
+void scan_record_nul_as(const char *p, const char *end, const char *delim, size_t dlen,
+                        char nul_as, scan_rec *rec);
+
+#endif
@@ -0,0 +1,99 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include "util/spill.h"
+
+#define SPILL_MIN_SIZE 4096         // First allocation for buf
+#define SPILL_COPY_SIZE (64 << 10)  // Bytes read back from the file at a time
+
+void spill_init(spill *s, size_t cap)
+{
+    s->buf = NULL;
+    s->len = s->size = 0;
+    s->cap = cap;
+    s->fp = NULL;
+    s->spilled = 0;
+    s->error = 0;
+}
+
+void spill_free(spill *s)
+{
+    free(s->buf);
+    if (s->fp != NULL) fclose(s->fp);
+    spill_init(s, s->cap);
+}
+
+// Grow buf geometrically to hold at least need bytes, but no more than cap:
+static int spill_grow(spill *s, size_t need)
+{
+    size_t size = s->size ? s->size : SPILL_MIN_SIZE;
+
+    while (size < need) size *= 2;
+    if (size > s->cap) size = s->cap;
+
+    char *buf = realloc(s->buf, size);
+    if (buf == NULL) return -1;
+    s->buf = buf;
+    s->size = size;
+    return 0;
+}
+
+int spill_add(spill *s, const void *p, size_t n)
+{
+    const char *c = p;
+
+    if (s->error) return -1;
+
+    // Fill memory first, up to cap:
+    if (s->spilled == 0 && s->len < s->cap) {
+        size_t take = s->cap - s->len;
+        if (take > n) take = n;
+        if (s->len + take > s->size && spill_grow(s, s->len + take) != 0) goto error;
+        memcpy(s->buf + s->len, c, take);
+        s->len += take;
+        c += take;
+        n -= take;
+    }
+
+    if (n > 0) {
+        if (s->fp == NULL && (s->fp = tmpfile()) == NULL) goto error;
+        if (s->spilled == 0 && fseeko(s->fp, 0, SEEK_SET) != 0) goto error;
+        if (fwrite(c, 1, n, s->fp) != n) goto error;
+        s->spilled += n;
+    }
+
+    return 0;
+
+error:
+    s->error = 1;
+    return -1;
+}
+
+int spill_write(spill *s, outbuf *o)
+{
+    if (s->error) return -1;
+
+    outbuf_write(o, s->buf, s->len);
+
+    if (s->spilled > 0) {
+        char chunk[SPILL_COPY_SIZE];
+        size_t left = s->spilled;
+
+        if (fflush(s->fp) != 0 || fseeko(s->fp, 0, SEEK_SET) != 0) return -1;
+        while (left > 0) {
+            size_t n = fread(chunk, 1, left < sizeof(chunk) ? left : sizeof(chunk), s->fp);
+            if (n == 0) return -1;
+            outbuf_write(o, chunk, n);
+            left -= n;
+        }
+    }
+
+    return o->error ? -1 : 0;
+}
+
+void spill_reset(spill *s)
+{
+    s->len = 0;
+    s->spilled = 0;
+    s->error = 0;
+}
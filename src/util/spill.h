@@ -0,0 +1,32 @@
+#ifndef __spill_h__
+#define __spill_h__
+
+#include <stdio.h>
+#include "util/outbuf.h"
+
+// Bytes collected piece by piece (e.g. a record read in several blocks) to
+// be output later.  Up to cap bytes are kept in memory; the rest goes to a
+// temporary file, so memory use stays bounded however much is added.
+typedef struct spill {
+    char *buf;              // The first bytes, in memory
+    size_t len;             // Bytes used in buf
+    size_t size;            // Allocated size for buf
+    size_t cap;             // Most bytes kept in buf
+    FILE *fp;               // Temporary file for the rest, once needed
+    size_t spilled;         // Bytes written to fp since the last reset
+    int error;              // Set once adding bytes failed
+} spill;
+
+void spill_init(spill *s, size_t cap);
+void spill_free(spill *s);
+
+// Append n bytes from p.  Returns 0 on success, -1 on error.
+int spill_add(spill *s, const void *p, size_t n);
+
+// Copy everything added since the last reset to o.  Returns 0 on success.
+int spill_write(spill *s, outbuf *o);
+
+// Forget what was added; the memory and the file are kept for reuse.
+void spill_reset(spill *s);
+
+#endif
@@ -0,0 +1,189 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <errno.h>
+#include <string.h>
+#include "util/uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static void uring_clear(uring *u)
+{
+    u->fd = -1;
+    u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+    u->sq_ring_size = u->cq_ring_size = u->sqes_size = 0;
+    u->queued = 0;
+}
+
+int uring_init(uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq = NULL;
+    char *cq = NULL;
+
+    uring_clear(u);
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) goto error;
+
+    // IORING_OP_READ came with this feature (Linux 5.6); older kernels
+    // would fail every read:
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) goto error;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        // Both queues share one mapping:
+        if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = 0;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) goto error;
+    if (u->cq_ring_size == 0) {
+        u->cq_ring = u->sq_ring;
+    }
+    else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) goto error;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto error;
+
+    sq = u->sq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq = u->cq_ring;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = cq + p.cq_off.cqes;
+
+    return 0;
+
+error:
+    uring_free(u);
+    return -1;
+}
+
+void uring_free(uring *u)
+{
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0) close(u->fd);
+    uring_clear(u);
+}
+
+int uring_read(uring *u, int fd, void *buf, unsigned len, uint64_t offset, uint64_t tag)
+{
+    unsigned tail = *u->sq_tail;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask) return -1;
+
+    unsigned i = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)u->sqes + i;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = tag;
+    u->sq_array[i] = i;
+
+    // The kernel may look at the entry once it sees the new tail:
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return 0;
+}
+
+static int uring_enter(uring *u, unsigned wait)
+{
+    while (1) {
+        int n = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, wait,
+                             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            u->queued -= (unsigned)n;
+            return 0;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+int uring_submit(uring *u)
+{
+    return (u->queued > 0) ? uring_enter(u, 0) : 0;
+}
+
+int uring_wait(uring *u, uint64_t *tag, int *res)
+{
+    while (1) {
+        unsigned head = *u->cq_head;
+
+        if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)u->cqes + (head & *u->cq_mask);
+            *tag = cqe->user_data;
+            *res = cqe->res;
+            // The slot can be reused once the kernel sees the new head:
+            __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (uring_enter(u, 1) != 0) return -1;
+    }
+}
+
+#else
+
+int uring_init(uring *u, unsigned entries)
+{
+    (void)entries;
+    u->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_free(uring *u)
+{
+    u->fd = -1;
+}
+
+int uring_read(uring *u, int fd, void *buf, unsigned len, uint64_t offset, uint64_t tag)
+{
+    (void)u; (void)fd; (void)buf; (void)len; (void)offset; (void)tag;
+    return -1;
+}
+
+int uring_submit(uring *u)
+{
+    (void)u;
+    return -1;
+}
+
+int uring_wait(uring *u, uint64_t *tag, int *res)
+{
+    (void)u; (void)tag; (void)res;
+    return -1;
+}
+
+#endif
+
+int uring_available(void)
+{
+    uring u;
+
+    if (uring_init(&u, 1) != 0) return 0;
+    uring_free(&u);
+    return 1;
+}
@@ -0,0 +1,48 @@
+#ifndef __uring_h__
+#define __uring_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A minimal io_uring through its system calls (no liburing), for keeping
+// several reads in flight.  Without io_uring at build time, or when the
+// kernel refuses it, uring_init() fails and the caller reads some other way.
+typedef struct uring {
+    int fd;                 // The ring, -1 if not set up
+    unsigned *sq_head;      // Submission queue, shared with the kernel
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    void *sqes;
+    unsigned *cq_head;      // Completion queue, likewise
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+    void *sq_ring;          // The mappings, and their sizes
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned queued;        // Entries not yet submitted
+} uring;
+
+// Set up a ring for up to entries requests in flight.  Returns 0 on success,
+// -1 if io_uring can't be used.
+int uring_init(uring *u, unsigned entries);
+void uring_free(uring *u);
+
+// Whether uring_init() would succeed.
+int uring_available(void);
+
+// Queue a read of len bytes at offset of fd into buf; tag comes back with
+// its completion.  Returns 0, or -1 if the queue is full.
+int uring_read(uring *u, int fd, void *buf, unsigned len, uint64_t offset, uint64_t tag);
+
+// Submit what's queued.  Returns 0 on success, -1 on error.
+int uring_submit(uring *u);
+
+// Submit what's queued and wait for a completion: the tag of its request,
+// and the bytes read or a negative errno.  Returns 0 on success, -1 on error.
+int uring_wait(uring *u, uint64_t *tag, int *res);
+
+#endif